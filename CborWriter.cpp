@@ -0,0 +1,116 @@
+#include "CborWriter.h"
+
+#include <string.h>
+
+enum {
+    CBOR_UINT = 0,
+    CBOR_NEGINT = 1,
+    CBOR_TEXT = 3,
+    CBOR_ARRAY = 4,
+    CBOR_MAP = 5,
+    CBOR_SIMPLE = 7
+};
+
+void CborWriter::put(const uint8_t * data, size_t dataLen)
+{
+    if (overflowed || len + dataLen > size)
+    {
+        overflowed = true;
+        return;
+    }
+
+    memcpy(&buf[len], data, dataLen);
+    len += dataLen;
+}
+
+/**
+ * Writes the major type and its argument in the shortest form, the
+ * argument big endian after the initial byte when it needs one.
+ **/
+void CborWriter::head(uint8_t major, uint64_t value)
+{
+    uint8_t out[9];
+    size_t bytes;
+
+    if (value < 24)
+    {
+        out[0] = (major << 5) | value;
+        put(out, 1);
+        return;
+    }
+
+    if (value <= 0xFF)
+    {
+        out[0] = (major << 5) | 24;
+        bytes = 1;
+    }
+    else if (value <= 0xFFFF)
+    {
+        out[0] = (major << 5) | 25;
+        bytes = 2;
+    }
+    else if (value <= 0xFFFFFFFFULL)
+    {
+        out[0] = (major << 5) | 26;
+        bytes = 4;
+    }
+    else
+    {
+        out[0] = (major << 5) | 27;
+        bytes = 8;
+    }
+
+    for (size_t i = 0; i < bytes; i++)
+        out[bytes - i] = (value >> (8 * i)) & 0xFF;
+
+    put(out, bytes + 1);
+}
+
+void CborWriter::uint64(uint64_t value)
+{
+    head(CBOR_UINT, value);
+}
+
+void CborWriter::int64(int64_t value)
+{
+    if (value < 0)
+        head(CBOR_NEGINT, (uint64_t) (-1 - value));
+    else
+        head(CBOR_UINT, (uint64_t) value);
+}
+
+void CborWriter::text(const char * str, size_t strLen)
+{
+    head(CBOR_TEXT, strLen);
+    put((const uint8_t *) str, strLen);
+}
+
+void CborWriter::text(const char * str)
+{
+    text(str, strlen(str));
+}
+
+void CborWriter::float32(float value)
+{
+    uint32_t bits;
+    uint8_t out[5];
+
+    memcpy(&bits, &value, sizeof(bits));
+    out[0] = (CBOR_SIMPLE << 5) | 26;
+    out[1] = bits >> 24;
+    out[2] = bits >> 16;
+    out[3] = bits >> 8;
+    out[4] = bits;
+
+    put(out, sizeof(out));
+}
+
+void CborWriter::startArray(size_t count)
+{
+    head(CBOR_ARRAY, count);
+}
+
+void CborWriter::startMap(size_t count)
+{
+    head(CBOR_MAP, count);
+}
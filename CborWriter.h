@@ -0,0 +1,47 @@
+#ifndef _CBOR_WRITER_H_
+#define _CBOR_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Minimal CBOR (RFC 7049) encoder writing into a fixed buffer.
+ *
+ * Only the items the telemetry needs are supported: integers, text
+ * strings, single precision floats, and arrays and maps of a known
+ * length. Nothing is written past the end of the buffer; once an item
+ * does not fit the writer stops and overflow() reports it.
+ **/
+class CborWriter
+{
+public:
+    CborWriter(uint8_t * aBuf, size_t aSize)
+        : buf(aBuf),
+          size(aSize),
+          len(0),
+          overflowed(false)
+    {
+    }
+
+    void uint64(uint64_t value);
+    void int64(int64_t value);
+    void text(const char * str, size_t strLen);
+    void text(const char * str);
+    void float32(float value);
+    void startArray(size_t count);
+    void startMap(size_t count);
+
+    size_t length() const { return len; }
+    bool overflow() const { return overflowed; }
+
+private:
+    uint8_t * buf;
+    size_t size;
+    size_t len;
+    bool overflowed;
+
+    void head(uint8_t major, uint64_t value);
+    void put(const uint8_t * data, size_t dataLen);
+};
+
+#endif
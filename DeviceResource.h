@@ -1,12 +1,34 @@
-
 #ifndef _DEVICE_RESOURCE_H_
 #define _DEVICE_RESOURCE_H_
 
+#include <stdint.h>
+
+// A numeric reading in fixed point: value * 10^-scale in unit,
+// e.g. 231 with scale 1 and unit "C" is 23.1 C
+struct DeviceSample {
+    int32_t value;
+    uint8_t scale;     // decimal places
+    const char* unit;
+    long long time;    // when it was read, ms since the epoch
+
+    double to_double() const {
+        double v = value;
+        for (uint8_t i = 0; i < scale; i++)
+            v /= 10;
+        return v;
+    }
+};
+
 // Abstract class
 class DeviceResource {
 public:
-    virtual std::string resource_type() =0;
-    virtual std::string get_value_string() =0;
+    virtual const char* resource_type() =0;
+    // gets the newest value as a number, returns false if the resource has none
+    virtual bool get_sample(DeviceSample &sample) =0;
+    // cursor into the history of numeric samples, count samples before the newest
+    virtual uint32_t history_cursor(uint32_t count) =0;
+    // reads the sample at cursor and moves past it, returns false when there is no newer one
+    virtual bool next_sample(uint32_t &cursor, DeviceSample &sample) =0;
 };
 
 #endif
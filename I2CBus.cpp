@@ -0,0 +1,188 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "I2CBus.h"
+
+#define I2CBUS_FLAG_QUEUED  (1UL << 0)
+#define I2CBUS_FLAG_DONE    (1UL << 1)
+#define I2CBUS_FLAG_FAILED  (1UL << 2)
+
+/*
+ *  Blocking caller waiting for its transaction
+ */
+struct I2CBusWaiter {
+    Semaphore   sem;
+    int         result;
+
+    void done(int r)
+    {
+        result = r;
+        sem.release();
+    }
+};
+
+I2CBus::I2CBus (PinName sda, PinName scl):
+    _i2c(sda, scl), _thread(osPriorityAboveNormal, I2CBUS_STACK_SIZE),
+    _space(MBED_CONF_APP_I2C_QUEUE_SIZE)
+{
+    _head = 0;
+    _count = 0;
+    _started = false;
+}
+/*
+ *  Queue a transaction without waiting for room
+ */
+int I2CBus::transfer(int addr, const char *tx, int txLen, char *rx, int rxLen,
+                     const Callback<void(int)> &done, EventQueue *queue)
+{
+    return enqueue(addr, tx, txLen, rx, rxLen, done, queue, 0);
+}
+/*
+ *  Queue a transaction, waiting up to timeout ms for room in the queue
+ *  The bus thread is started by the first one, so that nothing runs
+ *  before the kernel does
+ */
+int I2CBus::enqueue(int addr, const char *tx, int txLen, char *rx, int rxLen,
+                    const Callback<void(int)> &done, EventQueue *queue, uint32_t timeout)
+{
+    if(_space.wait(timeout) <= 0) {
+        return -1;
+    }
+    _mutex.lock();
+    Transaction &t = _queue[(_head + _count) % MBED_CONF_APP_I2C_QUEUE_SIZE];
+    t.addr = addr;
+    t.tx = tx;
+    t.txLen = txLen;
+    t.rx = rx;
+    t.rxLen = rxLen;
+    t.done = done;
+    t.queue = queue;
+    _count++;
+    if(!_started) {
+        _started = true;
+        _thread.start(callback(this, &I2CBus::run));
+    }
+    _mutex.unlock();
+
+    _flags.set(I2CBUS_FLAG_QUEUED);
+    return 0;
+}
+/*
+ *  Blocking transfers
+ */
+int I2CBus::write(int addr, const char *data, int len)
+{
+    return writeRead(addr, data, len, NULL, 0);
+}
+
+int I2CBus::read(int addr, char *data, int len)
+{
+    return writeRead(addr, NULL, 0, data, len);
+}
+
+int I2CBus::writeRead(int addr, const char *tx, int txLen, char *rx, int rxLen)
+{
+    I2CBusWaiter waiter;
+
+    // A transaction ahead frees its slot within the transfer timeout
+    if(enqueue(addr, tx, txLen, rx, rxLen, callback(&waiter, &I2CBusWaiter::done), NULL,
+               MBED_CONF_APP_I2C_TIMEOUT_MS) != 0) {
+        return -1;
+    }
+    waiter.sem.wait();
+    return waiter.result;
+}
+/*
+ *  Take the oldest transaction off the queue
+ */
+bool I2CBus::next(Transaction &t)
+{
+    _mutex.lock();
+    bool found = (_count > 0);
+    if(found) {
+        t = _queue[_head];
+        _head = (_head + 1) % MBED_CONF_APP_I2C_QUEUE_SIZE;
+        _count--;
+    }
+    _mutex.unlock();
+    if(found) {
+        _space.release();
+    }
+    return found;
+}
+/*
+ *  Run one transaction and wait for it to finish
+ *  A transfer that does not complete in time is aborted, so that a
+ *  device holding the clock low cannot stall the whole bus
+ */
+int I2CBus::execute(const Transaction &t)
+{
+#if DEVICE_I2C_ASYNCH
+    _flags.clear(I2CBUS_FLAG_DONE | I2CBUS_FLAG_FAILED);
+    if(_i2c.transfer(t.addr, t.tx, t.txLen, t.rx, t.rxLen,
+                     callback(this, &I2CBus::onEvent), I2C_EVENT_ALL) != 0) {
+        return -1;
+    }
+    uint32_t flags = _flags.wait_any(I2CBUS_FLAG_DONE | I2CBUS_FLAG_FAILED, MBED_CONF_APP_I2C_TIMEOUT_MS);
+    if(flags & osFlagsError) {
+        _i2c.abort_transfer();
+        return -1;
+    }
+    return (flags & I2CBUS_FLAG_DONE) ? 0 : -1;
+#else
+    if(t.txLen > 0 && _i2c.write(t.addr, t.tx, t.txLen, t.rxLen > 0) != 0) {
+        return -1;
+    }
+    if(t.rxLen > 0 && _i2c.read(t.addr, t.rx, t.rxLen) != 0) {
+        return -1;
+    }
+    return 0;
+#endif
+}
+/*
+ *  Bus thread
+ *  Drains the queue each time something is added to it
+ */
+void I2CBus::run(void)
+{
+    Transaction t;
+
+    while(true) {
+        _flags.wait_any(I2CBUS_FLAG_QUEUED);
+        while(next(t)) {
+            int result = execute(t);
+            if(t.done) {
+                if(t.queue) {
+                    t.queue->call(t.done, result);
+                } else {
+                    t.done(result);
+                }
+            }
+        }
+    }
+}
+/*
+ *  Transfer interrupt
+ */
+void I2CBus::onEvent(int event)
+{
+    if((event & I2C_EVENT_TRANSFER_COMPLETE) &&
+       !(event & (I2C_EVENT_ERROR | I2C_EVENT_ERROR_NO_SLAVE | I2C_EVENT_TRANSFER_EARLY_NACK))) {
+        _flags.set(I2CBUS_FLAG_DONE);
+    } else {
+        _flags.set(I2CBUS_FLAG_FAILED);
+    }
+}
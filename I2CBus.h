@@ -0,0 +1,99 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef I2CBUS_H
+#define I2CBUS_H
+
+#include "mbed.h"
+#include "rtos.h"
+
+// Transactions that can wait for the bus at the same time
+#ifndef MBED_CONF_APP_I2C_QUEUE_SIZE
+#define MBED_CONF_APP_I2C_QUEUE_SIZE 8
+#endif
+
+// Longest a single transaction may hold the bus, clock stretching included
+#ifndef MBED_CONF_APP_I2C_TIMEOUT_MS
+#define MBED_CONF_APP_I2C_TIMEOUT_MS 100
+#endif
+
+#define I2CBUS_STACK_SIZE   (1024)
+
+/*
+ *  One I2C bus shared by every driver on it. Transactions are queued and
+ *  run one after the other by the bus thread with the asynchronous
+ *  I2C::transfer(), which sleeps until the transfer interrupt instead of
+ *  polling, so no driver holds the CPU while another waits for the bus
+ *  and transfers of different drivers never interleave.
+ *
+ *  Addresses are 8-bit, as with I2C. Results are 0 when the transfer
+ *  completed and -1 when it was not acknowledged, failed or timed out.
+ */
+class I2CBus
+{
+    public:
+    I2CBus(PinName sda, PinName scl);
+
+    /*
+     *  Queues a write of tx followed by a read into rx, with a repeated
+     *  start in between; either length may be 0. Both buffers must stay
+     *  valid until done is called with the result. done runs on the bus
+     *  thread and must be short, or on queue when one is given. Returns
+     *  -1 if the queue is full, in which case done is not called.
+     */
+    int transfer(int addr, const char *tx, int txLen, char *rx, int rxLen,
+                 const Callback<void(int)> &done=Callback<void(int)>(), EventQueue *queue=NULL);
+
+    /*
+     *  Blocking transfers, waiting for their turn on the bus. When the
+     *  queue is full they wait up to the transfer timeout for room and
+     *  return -1 if none is made. They can only be used from threads
+     *  other than the bus thread.
+     */
+    int write(int addr, const char *data, int len);
+    int read(int addr, char *data, int len);
+    int writeRead(int addr, const char *tx, int txLen, char *rx, int rxLen);
+
+    protected:
+    struct Transaction {
+        int                     addr;
+        const char              *tx;
+        int                     txLen;
+        char                    *rx;
+        int                     rxLen;
+        Callback<void(int)>     done;
+        EventQueue              *queue;
+    };
+
+    I2C                         _i2c;
+    Thread                      _thread;
+    Mutex                       _mutex;
+    EventFlags                  _flags;
+    Semaphore                   _space;     // free entries of _queue
+    Transaction                 _queue[MBED_CONF_APP_I2C_QUEUE_SIZE];
+    int                         _head;
+    int                         _count;
+    bool                        _started;
+
+    int enqueue(int addr, const char *tx, int txLen, char *rx, int rxLen,
+                const Callback<void(int)> &done, EventQueue *queue, uint32_t timeout);
+    bool next(Transaction &t);
+    int execute(const Transaction &t);
+    void run(void);
+    void onEvent(int event);
+};
+
+#endif
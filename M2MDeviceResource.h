@@ -1,34 +1,84 @@
 #ifndef _DEVICE_RESOURCE_1_H_
 #define _DEVICE_RESOURCE_1_H_
 #include <string>
+#include <math.h>
 
+#include "rtos.h"
+#include "SampleRing.h"
 #include <m2mresource.h>
+#include <pal.h>
 
 class M2MDeviceResource : public DeviceResource {
 private:
 	M2MResource *res;
+	const char *unit;
+	uint8_t scale;
+	SampleRing<MBED_CONF_APP_SAMPLE_HISTORY_SIZE> history;
+
+    // wall clock time in ms since the epoch. pal_osGetTime() only counts
+    // seconds, so the kernel tick supplies the milliseconds and the result
+    // is kept within the second the wall clock is in, which also follows
+    // the clock when it is set. Shared by every resource.
+    static long long epoch_ms() {
+    	 static uint32_t last_tick;
+    	 static long long last_ms = -1;
+
+    	 long long sec_ms = (long long) pal_osGetTime() * 1000;
+    	 core_util_critical_section_enter();
+    	 uint32_t tick = osKernelGetTickCount();
+    	 long long ms = (last_ms < 0) ? sec_ms : last_ms + (uint32_t) (tick - last_tick);
+    	 if (ms < sec_ms)
+    	 	ms = sec_ms;
+    	 else if (ms > sec_ms + 999)
+    	 	ms = sec_ms + 999;
+    	 last_tick = tick;
+    	 last_ms = ms;
+    	 core_util_critical_section_exit();
+    	 return ms;
+    };
 
 public:
 
- 	M2MDeviceResource(M2MResource *source_res)
+ 	// unit and scale describe the numbers given to set_sample()
+ 	M2MDeviceResource(M2MResource *source_res, const char *source_unit = "", uint8_t source_scale = 0)
  	{
  		res=source_res;
+ 		unit=source_unit;
+ 		scale=source_scale;
  	}
 
-    std::string resource_type() {
-    	 m2m::String m = res->resource_type();
-    	 std::string s(m.c_str());
-    	 return s;
+    // records a reading as a number, rounded to the resource's scale,
+    // so publishers do not have to parse the text of the M2MResource.
+    // Only the thread that reads the sensor may call it.
+    void set_sample(float value) {
+    	 for (uint8_t i = 0; i < scale; i++)
+    	 	value *= 10;
+    	 history.push(epoch_ms(), lroundf(value));
+    };
+
+    bool get_sample(DeviceSample &out) {
+    	 uint32_t cursor = history.cursor(1);
+    	 return next_sample(cursor, out);
+    };
 
-    	//return "Hello1";
+    uint32_t history_cursor(uint32_t count) {
+    	 return history.cursor(count);
     };
 
-    std::string get_value_string() {
-    	 m2m::String m = res->get_value_string();
-    	 std::string s(m.c_str());
-    	 return s;
+    bool next_sample(uint32_t &cursor, DeviceSample &out) {
+    	 SampleRing<MBED_CONF_APP_SAMPLE_HISTORY_SIZE>::Entry e;
+    	 if (!history.read(cursor, e))
+    	 	return false;
+
+    	 out.value = e.value;
+    	 out.scale = scale;
+    	 out.unit = unit;
+    	 out.time = e.time;
+    	 return true;
+    };
 
-    	//return "Hello2";
+    const char* resource_type() {
+    	 return res->resource_type();
     };
 };
 
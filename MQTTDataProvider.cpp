@@ -1,12 +1,17 @@
 #include <cstdio>
+#include <cmath>
 
 #include "mbed.h"
 #include "rtos.h"
 #undef MBED_CONF_APP_ESP8266_DEBUG
 #include "EthernetInterface.h"
 #include "MQTTThreadedClient.h"
+#include "MQTTSpool.h"
 #include "mbedtls/platform.h"
 #include "MQTTDataProvider.h"
+#include "CborWriter.h"
+#include "rapidjson/allocators.h"
+#include "rapidjson/writer.h"
 #include <pal.h>
 
 using namespace MQTT;
@@ -23,67 +28,429 @@ using namespace MQTT;
       bool isDER=false;
 #endif
 
-int arrivedcount = 0;
+void MQTTDataProvider::setDeadband(const char* path, float absolute, float percent) {
 
-void messageArrived(MessageData& md)
-{
-    Message &message = md.message;
-    printf("Arrived Callback 1 : qos %d, retained %d, dup %d, packetid %d\r\n", message.qos, message.retained, message.dup, message.id);
-    printf("Payload [%.*s]\r\n", message.payloadlen, (char*)message.payload);
-    ++arrivedcount;
+   size_t j=0; // resource counter
+   for( std::map<string,DeviceResource*>::const_iterator it = resources.begin(); it != resources.end() && j < MQTT_BATCH_MAX_RESOURCES; ++it, ++j )
+   {
+      if (it->first == path) {
+         reports[j].absolute = absolute;
+         reports[j].percent = percent;
+         return;
+      }
+   }
 }
 
-string MQTTDataProvider::getData() {
+/**
+ * A value is worth reporting when it is the first one, when the
+ * heartbeat is due, or when it moved out of the deadband around the
+ * last reported value: further than the absolute or the percent band,
+ * or at all if neither is set.
+ **/
+bool MQTTDataProvider::hasChanged(size_t j, const DeviceSample &sample) {
+
+   Report &r = reports[j];
+
+   if (!r.reported)
+      return true;
+   if (MBED_CONF_APP_MQTT_HEARTBEAT_MS > 0 && sample.time - r.lastTime >= MBED_CONF_APP_MQTT_HEARTBEAT_MS)
+      return true;
+
+   double delta = fabs(sample.to_double() - r.last);
+   if (r.absolute <= 0 && r.percent <= 0)
+      return delta > 0;
+   if (r.absolute > 0 && delta > r.absolute)
+      return true;
+   if (r.percent > 0 && delta > fabs(r.last) * r.percent / 100)
+      return true;
+   return false;
+}
 
-   //returns JSON as described here: https://confluence.arm.com/display/IoTBU/Message+Structure
-   char str_time[32];
-   uint64_t currTimeSeconds = pal_osGetTime();
-   long long int currTimeMillis = currTimeSeconds * 1000;
-   sprintf(str_time, "%lld", currTimeMillis);
+bool MQTTDataProvider::addSamples() {
 
-   string json="{\"f\": \"1\",";
-   json += "\"id\": \"";
-   json += deviceId;
-   json += "\",";
-   json += "\"d\": [";
+   bool full = false;
 
-   size_t j=0; // resource counter - it is used to print or not to print the comma after 
-   for( std::map<string,DeviceResource*>::const_iterator it = resources.begin(); it != resources.end(); ++it )
+   size_t j=0; // resource counter
+   for( std::map<string,DeviceResource*>::const_iterator it = resources.begin(); it != resources.end() && j < MQTT_BATCH_MAX_RESOURCES; ++it, ++j )
    {
-      //printf ("%d=>  str_resource key=%s  value=%s \r\n",j,(it->first).c_str(), (it->second)->get_value_string().c_str());
-
-      j++;
-      json += "{";
-      json += "\"";
-      json += it->first;   //resource_path
-      json += "\": [";
-      json += "{";
-      json += "\"t\": ";
-      json +=str_time;
-      json += ",";
-
-      json += "\"v\": {";
-
-      json += "\"";
-      json += (it->second)->resource_type();
-      json += "\":";
-      json += "\"";
-      json += (it->second)->get_value_string();
-      json += "\"";
-      json += "}";
-      json += "}";
-      json += "]";
-
-      json += "}";
-      if (resources.size() > j) json += ",";
-         json += "";
+      // Samples that do not fit stay in the history for the next batch
+      DeviceSample sample;
+      while (batchLen[j] < MBED_CONF_APP_MQTT_BATCH_SIZE && (it->second)->next_sample(cursors[j], sample))
+      {
+         if (!hasChanged(j, sample))
+            continue;
+
+         batch[j][batchLen[j]++] = sample;
+         batchCount++;
+         reports[j].last = sample.to_double();
+         reports[j].lastTime = sample.time;
+         reports[j].reported = true;
+      }
 
+      if (batchLen[j] == MBED_CONF_APP_MQTT_BATCH_SIZE)
+         full = true;
    }
 
-    json += "]}";
+   return full;
+}
+
+void MQTTDataProvider::clearBatch() {
+
+   for (size_t j = 0; j < MQTT_BATCH_MAX_RESOURCES; j++)
+      batchLen[j] = 0;
+   batchCount = 0;
+}
+
+void MQTTDataProvider::addToSummaries() {
+
+   size_t j=0; // resource counter
+   for( std::map<string,DeviceResource*>::const_iterator it = resources.begin(); it != resources.end() && j < MQTT_BATCH_MAX_RESOURCES; ++it, ++j )
+   {
+      Summary &sum = summaries[j];
+      DeviceSample sample;
+
+      while ((it->second)->next_sample(cursors[j], sample))
+      {
+         double v = sample.to_double();
+
+         if (sum.count == 0) {
+            sum.min = sum.max = sample.value;
+            sum.mean = sum.m2 = 0;
+            sum.first = sample.time;
+            sum.scale = sample.scale;
+            sum.unit = sample.unit;
+         }
+         if (sample.value < sum.min) sum.min = sample.value;
+         if (sample.value > sum.max) sum.max = sample.value;
+         sum.last = sample.time;
+
+         sum.count++;
+         double delta = v - sum.mean;
+         sum.mean += delta / sum.count;
+         sum.m2 += delta * (v - sum.mean);
+      }
+   }
+}
+
+void MQTTDataProvider::clearSummaries() {
+
+   for (size_t j = 0; j < MQTT_BATCH_MAX_RESOURCES; j++)
+      summaries[j].count = 0;
+}
+
+static double fixedToDouble(int32_t value, uint8_t scale) {
 
-    // printf(" ===> END getData() counter=%d \r\n", i);
-    return json;
+   DeviceSample s;
+   s.value = value;
+   s.scale = scale;
+   return s.to_double();
+}
+
+/**
+ * rapidjson output stream over a fixed buffer. It stops at the end of
+ * the buffer, keeping room for the terminating null, and remembers
+ * that the JSON did not fit.
+ **/
+class FixedBufferStream {
+public:
+    typedef char Ch;
+
+    FixedBufferStream(char *aBuf, size_t aSize) : buf(aBuf), size(aSize), len(0), overflow(false) {}
+
+    void Put(Ch c) {
+        if (len + 1 < size)
+            buf[len++] = c;
+        else
+            overflow = true;
+    }
+    void Flush() {}
+
+    char *buf;
+    size_t size;
+    size_t len;
+    bool overflow;
+};
+
+typedef rapidjson::Writer<FixedBufferStream, rapidjson::UTF8<>, rapidjson::UTF8<>, rapidjson::MemoryPoolAllocator<> > FixedBufferWriter;
+
+int MQTTDataProvider::getPayload(char *buf, size_t size) {
+
+#if MBED_CONF_APP_MQTT_AGGREGATE && MBED_CONF_APP_MQTT_PAYLOAD_CBOR
+   return getSummaryCbor(buf, size);
+#elif MBED_CONF_APP_MQTT_AGGREGATE
+   return getSummary(buf, size);
+#elif MBED_CONF_APP_MQTT_PAYLOAD_CBOR
+   return getDataCbor(buf, size);
+#else
+   return getData(buf, size);
+#endif
+}
+
+int MQTTDataProvider::getData(char *buf, size_t size) {
+
+   //writes JSON as described here: https://confluence.arm.com/display/IoTBU/Message+Structure
+   //with all the samples of the batch in the array of each resource:
+   //{"f":"1","id":"<id>","d":[{"<path>":[{"t":<ms>,"v":{"<type>":<value>},"u":"<unit>"},...]},...]}
+   //
+   //Values go as JSON numbers, stamped with the time they were read.
+   //
+   //Nothing here touches the heap, the writer keeps its nesting
+   //stack in a pool over stackBuffer and the JSON goes straight to buf.
+   char stackBuffer[128];
+   rapidjson::MemoryPoolAllocator<> stackAllocator(stackBuffer, sizeof(stackBuffer));
+   FixedBufferStream stream(buf, size);
+   FixedBufferWriter writer(stream, &stackAllocator, 6);
+
+   writer.StartObject();
+   writer.Key("f");
+   writer.String("1");
+   writer.Key("id");
+   writer.String(deviceId);
+   writer.Key("d");
+   writer.StartArray();
+
+   size_t j=0; // resource counter
+   for( std::map<string,DeviceResource*>::const_iterator it = resources.begin(); it != resources.end() && j < MQTT_BATCH_MAX_RESOURCES && !stream.overflow; ++it, ++j )
+   {
+      // Leave out the resources that did not change
+      if (batchLen[j] == 0)
+         continue;
+
+      const char *type = (it->second)->resource_type();
+
+      writer.StartObject();
+      writer.Key(it->first.c_str(), it->first.length());   //resource_path
+      writer.StartArray();
+
+      for (int i = 0; i < batchLen[j]; i++)
+      {
+         const DeviceSample &sample = batch[j][i];
+
+         writer.StartObject();
+         writer.Key("t");
+         writer.Int64(sample.time);
+         writer.Key("v");
+         writer.StartObject();
+         writer.Key(type);
+         if (sample.scale == 0)
+            writer.Int(sample.value);
+         else
+            writer.Double(sample.to_double());
+         writer.EndObject();
+         if (sample.unit[0] != '\0') {
+            writer.Key("u");
+            writer.String(sample.unit);
+         }
+         writer.EndObject();
+      }
+
+      writer.EndArray();
+      writer.EndObject();
+   }
+
+   writer.EndArray();
+   writer.EndObject();
+
+   if (stream.overflow)
+      return -1;
+
+   buf[stream.len] = '\0';
+   return stream.len;
+}
+
+int MQTTDataProvider::getDataCbor(char *buf, size_t size) {
+
+   //writes the batch as CBOR, a map with integer keys:
+   //  0: format version, 2
+   //  1: device id
+   //  2: time of the oldest sample, ms since the epoch
+   //  3: {resource index: [ms since the oldest sample, value, ...]}
+   //     resources that did not change are left out
+   //
+   //Resources are numbered in the order of their paths, so for
+   //humidity, light and temperature they are 0, 1 and 2. Values go as
+   //integers, or single floats when they have decimals.
+   CborWriter writer((uint8_t *) buf, size);
+
+   size_t resourceCount = resources.size();
+   if (resourceCount > MQTT_BATCH_MAX_RESOURCES)
+      resourceCount = MQTT_BATCH_MAX_RESOURCES;
+
+   long long base = 0;
+   size_t changedCount = 0;
+   for (size_t j = 0; j < resourceCount; j++)
+   {
+      if (batchLen[j] == 0)
+         continue;
+      if (changedCount == 0 || batch[j][0].time < base)
+         base = batch[j][0].time;
+      changedCount++;
+   }
+
+   writer.startMap(4);
+   writer.uint64(0);
+   writer.uint64(2);
+   writer.uint64(1);
+   writer.text(deviceId);
+   writer.uint64(2);
+   writer.int64(base);
+
+   writer.uint64(3);
+   writer.startMap(changedCount);
+   for (size_t j = 0; j < resourceCount && !writer.overflow(); j++)
+   {
+      if (batchLen[j] == 0)
+         continue;
+
+      writer.uint64(j);
+      writer.startArray(2 * batchLen[j]);
+      for (int i = 0; i < batchLen[j]; i++)
+      {
+         const DeviceSample &sample = batch[j][i];
+
+         writer.int64(sample.time - base);
+         if (sample.scale == 0)
+            writer.int64(sample.value);
+         else
+            writer.float32((float) sample.to_double());
+      }
+   }
+
+   if (writer.overflow())
+      return -1;
+
+   return writer.length();
+}
+
+int MQTTDataProvider::getSummary(char *buf, size_t size) {
+
+   //writes the summaries in the same shape as getData(), one entry per
+   //resource holding the mean as the value, stamped with the time of
+   //the last sample, and the other figures next to it:
+   //{"f":"1","id":"<id>","d":[{"<path>":[{"t":<ms>,"v":{"<type>":<mean>},
+   //   "n":<count>,"min":<min>,"max":<max>,"sd":<stddev>,"u":"<unit>"}]},...]}
+   char stackBuffer[128];
+   rapidjson::MemoryPoolAllocator<> stackAllocator(stackBuffer, sizeof(stackBuffer));
+   FixedBufferStream stream(buf, size);
+   FixedBufferWriter writer(stream, &stackAllocator, 6);
+
+   writer.StartObject();
+   writer.Key("f");
+   writer.String("1");
+   writer.Key("id");
+   writer.String(deviceId);
+   writer.Key("d");
+   writer.StartArray();
+
+   size_t j=0; // resource counter
+   for( std::map<string,DeviceResource*>::const_iterator it = resources.begin(); it != resources.end() && j < MQTT_BATCH_MAX_RESOURCES && !stream.overflow; ++it, ++j )
+   {
+      const Summary &sum = summaries[j];
+      if (sum.count == 0)
+         continue;
+
+      writer.StartObject();
+      writer.Key(it->first.c_str(), it->first.length());   //resource_path
+      writer.StartArray();
+
+      writer.StartObject();
+      writer.Key("t");
+      writer.Int64(sum.last);
+      writer.Key("v");
+      writer.StartObject();
+      writer.Key((it->second)->resource_type());
+      writer.Double(sum.mean);
+      writer.EndObject();
+      writer.Key("n");
+      writer.Int(sum.count);
+      writer.Key("min");
+      writer.Double(fixedToDouble(sum.min, sum.scale));
+      writer.Key("max");
+      writer.Double(fixedToDouble(sum.max, sum.scale));
+      writer.Key("sd");
+      writer.Double(sqrt(sum.m2 / sum.count));
+      if (sum.unit[0] != '\0') {
+         writer.Key("u");
+         writer.String(sum.unit);
+      }
+      writer.EndObject();
+
+      writer.EndArray();
+      writer.EndObject();
+   }
+
+   writer.EndArray();
+   writer.EndObject();
+
+   if (stream.overflow)
+      return -1;
+
+   buf[stream.len] = '\0';
+   return stream.len;
+}
+
+int MQTTDataProvider::getSummaryCbor(char *buf, size_t size) {
+
+   //writes the summaries as CBOR, a map with integer keys:
+   //  0: format version, 3
+   //  1: device id
+   //  2: time of the oldest sample, ms since the epoch
+   //  3: {resource index: [count, min, max, mean, standard deviation]}
+   //     resources without samples are left out
+   //  4: ms from the oldest to the newest sample
+   //
+   //Resources are numbered as in getDataCbor(). The figures go as
+   //single floats.
+   CborWriter writer((uint8_t *) buf, size);
+
+   size_t resourceCount = resources.size();
+   if (resourceCount > MQTT_BATCH_MAX_RESOURCES)
+      resourceCount = MQTT_BATCH_MAX_RESOURCES;
+
+   long long first = 0, last = 0;
+   size_t sampledCount = 0;
+   for (size_t j = 0; j < resourceCount; j++)
+   {
+      if (summaries[j].count == 0)
+         continue;
+      if (sampledCount == 0 || summaries[j].first < first)
+         first = summaries[j].first;
+      if (sampledCount == 0 || summaries[j].last > last)
+         last = summaries[j].last;
+      sampledCount++;
+   }
+
+   writer.startMap(5);
+   writer.uint64(0);
+   writer.uint64(3);
+   writer.uint64(1);
+   writer.text(deviceId);
+   writer.uint64(2);
+   writer.int64(first);
+   writer.uint64(4);
+   writer.int64(last - first);
+
+   writer.uint64(3);
+   writer.startMap(sampledCount);
+   for (size_t j = 0; j < resourceCount && !writer.overflow(); j++)
+   {
+      const Summary &sum = summaries[j];
+      if (sum.count == 0)
+         continue;
+
+      writer.uint64(j);
+      writer.startArray(5);
+      writer.uint64(sum.count);
+      writer.float32((float) fixedToDouble(sum.min, sum.scale));
+      writer.float32((float) fixedToDouble(sum.max, sum.scale));
+      writer.float32((float) sum.mean);
+      writer.float32((float) sqrt(sum.m2 / sum.count));
+   }
+
+   if (writer.overflow())
+      return -1;
+
+   return writer.length();
 }
 
 int checkAndSetTime(NetworkInterface *network) {
@@ -142,57 +509,126 @@ void MQTTDataProvider::run(NetworkInterface *network) {
     int port = 8883;
     // int port = 1883;
 
+    // The credentials are parsed once and can be shared by several
+    // clients; the client is static to keep its TLS state off this
+    // thread's stack.
 #ifdef MBED_CLOUD_CERT
       // DER format
-      MQTTThreadedClient mqtt(network, (const unsigned char*)(MBED_CLOUD_DEV_LWM2M_SERVER_ROOT_CA_CERTIFICATE), (const unsigned char*)MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_CERTIFICATE, (const unsigned char*)MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_PRIVATE_KEY, isDER);
-      // MQTTThreadedClient mqtt(network, (const unsigned char*)(NULL), (const unsigned char*)MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_CERTIFICATE, (const unsigned char*)MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_PRIVATE_KEY, isDER);
-
-      mqtt.ssl_ca_len          = sizeof(MBED_CLOUD_DEV_LWM2M_SERVER_ROOT_CA_CERTIFICATE);
-      mqtt.ssl_client_cert_len = sizeof(MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_CERTIFICATE);
-      mqtt.ssl_client_pkey_len = sizeof(MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_PRIVATE_KEY);
-
+      TLSCredentials *credentials = new TLSCredentials(
+            (const unsigned char*)MBED_CLOUD_DEV_LWM2M_SERVER_ROOT_CA_CERTIFICATE, sizeof(MBED_CLOUD_DEV_LWM2M_SERVER_ROOT_CA_CERTIFICATE),
+            (const unsigned char*)MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_CERTIFICATE, sizeof(MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_CERTIFICATE),
+            (const unsigned char*)MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_PRIVATE_KEY, sizeof(MBED_CLOUD_DEV_BOOTSTRAP_DEVICE_PRIVATE_KEY),
+            isDER);
 #else
       // PEM format
-      MQTTThreadedClient mqtt(network, (const unsigned char*)TLS_CA_PEM, (const unsigned char*)TLS_CLIENT_CERT, (const unsigned char*)TLS_CLIENT_PKEY, isDER);
+      TLSCredentials *credentials = new TLSCredentials(
+            (const unsigned char*)TLS_CA_PEM, 0,
+            (const unsigned char*)TLS_CLIENT_CERT, 0,
+            (const unsigned char*)TLS_CLIENT_PKEY, 0,
+            isDER);
 #endif
+    static MQTTThreadedClient mqtt(network, credentials);
 
     MQTTPacket_connectData logindata = MQTTPacket_connectData_initializer;
     logindata.MQTTVersion = 3;
+    // Let the broker keep our session across reconnects
+    logindata.cleansession = 0;
 
 
     logindata.clientID.cstring = (char *)  deviceId;
 
     mqtt.setConnectionParameters(hostname, port, logindata);
-    mqtt.addTopicHandler(topic_1, messageArrived);
+
+#if MBED_CONF_APP_MQTT_SPOOL_SIZE > 0
+    // Keep the telemetry of WiFi outages on flash and send it afterwards
+    static MQTTSpool spool;
+    if (spool.open() == SUCCESS)
+        mqtt.setSpool(&spool);
+#endif
 
     msgSender.start(mbed::callback(&mqtt, &MQTTThreadedClient::startListener));
 
 
+    Timer batchTimer;
+
     while(true)
     {
-         Thread::wait(1 * 2 * 1000);
-         PubMessage message;
-         message.qos = QOS0;
-         message.id = 123;
+         Thread::wait(MQTT_SAMPLE_PERIOD_MS);
+
+#if MBED_CONF_APP_MQTT_AGGREGATE
+         // Fold every new sample into the summaries and send those
+         // once per interval, however fast the sensors are sampled
+         addToSummaries();
+         batchTimer.start();
+         if (batchTimer.read_ms() + MQTT_SAMPLE_PERIOD_MS <= MBED_CONF_APP_MQTT_BATCH_PERIOD_MS)
+            continue;
+         batchTimer.reset();
+
+         // No sample arrived in the interval, there is nothing to send
+         bool sampled = false;
+         for (size_t j = 0; j < MQTT_BATCH_MAX_RESOURCES; j++)
+            sampled = sampled || summaries[j].count > 0;
+         if (!sampled)
+            continue;
+#else
+         // Collect the new samples of every resource until one has a
+         // full batch or the batch has waited long enough, then send
+         // them in one go. Only values that changed, or are due a
+         // heartbeat, are kept, so a quiet device sends little.
+         if (batchCount == 0)
+            batchTimer.reset();
+         batchTimer.start();
+         bool full = addSamples();
+         if (batchCount == 0)
+            continue;
+         if (!full && batchTimer.read_ms() + MQTT_SAMPLE_PERIOD_MS <= MBED_CONF_APP_MQTT_BATCH_PERIOD_MS)
+            continue;
+#endif
 
-         // if (i > 3) continue;  // This is temporary statement to concentrate on TLS handshake issue
+         // Fill the message in the client's pool directly, the JSON is
+         // written into its payload and sent from there without copies
+         PubMessage *message = mqtt.allocMessage();
+         if (message == NULL) {
+            printf("ERROR mqtt.allocMessage() no free message\r\n");
+            clearBatch();
+            clearSummaries();
+            continue;
+         }
 
-         strcpy(&message.topic[0], topic_1);
+         int len = getPayload(&message->payload[0], MAX_MQTT_PAYLOAD_SIZE);
+         clearBatch();
+         clearSummaries();
 
+         if  (len < 0){
+            // Drop the batch rather than stop publishing, make
+            // mqtt-batch-size smaller if this keeps happening
+            printf("ERROR payload lengh > %d  \r\n", MAX_MQTT_PAYLOAD_SIZE);
+            mqtt.freeMessage(message);
+            continue;
+         }
 
-         string json=getData();  //temporary commented to concentrate on TLS handshake issue
+         message->qos = QOS0;
 
-         if  (json.length() >= MAX_MQTT_PAYLOAD_SIZE){
-            printf("ERROR json lengh > %d  \r\n", MAX_MQTT_PAYLOAD_SIZE);
-            break;
-         }
+         strcpy(&message->topic[0], topic_1);
 
-         sprintf(&message.payload[0], "%s", json.c_str());
-         printf("sending payload to topic=%s payload=%s \r\n", &message.topic[0],   &message.payload[0] );
+         message->payloadlen = len;
+#if MBED_CONF_APP_MQTT_PAYLOAD_CBOR
+         printf("sending payload to topic=%s cbor of %d bytes \r\n", &message->topic[0], len);
+#else
+         printf("sending payload to topic=%s payload=%s \r\n", &message->topic[0],   &message->payload[0] );
+#endif
 
-         message.payloadlen = strlen((const char *) &message.payload[0]);
-         int ret = mqtt.publish(message);
-         if (ret) printf("ERROR mqtt.publish() ret=%d  ", ret);
+         // A single reading is only worth sending if it is the newest,
+         // replace the one still waiting instead of building a stale
+         // backlog. Batches carry history and are all kept.
+         int ret;
+         if (MBED_CONF_APP_MQTT_BATCH_SIZE > 1) {
+            ret = mqtt.publish(message);
+            if (ret) printf("ERROR mqtt.publish() ret=%d  ", ret);
+         } else {
+            ret = mqtt.publishLatest(message);
+            if (ret) printf("ERROR mqtt.publishLatest() ret=%d  ", ret);
+         }
          if (ret) Thread::wait(6000);
      }
 
@@ -7,26 +7,121 @@
 
 #include "DeviceResource.h"
 
+// Most samples of one resource collected into one message
+#ifndef MBED_CONF_APP_MQTT_BATCH_SIZE
+#define MBED_CONF_APP_MQTT_BATCH_SIZE 5
+#endif
+
+// Longest time in ms the first sample of a batch waits to be published
+#ifndef MBED_CONF_APP_MQTT_BATCH_PERIOD_MS
+#define MBED_CONF_APP_MQTT_BATCH_PERIOD_MS 30000
+#endif
+
+// Default deadband of a resource: a value is only reported when it
+// moved more than this from the last reported one, 0 reports any change
+#ifndef MBED_CONF_APP_MQTT_DEADBAND_ABS
+#define MBED_CONF_APP_MQTT_DEADBAND_ABS 0
+#endif
+
+// Default deadband in percent of the last reported value, 0 disables it
+#ifndef MBED_CONF_APP_MQTT_DEADBAND_PCT
+#define MBED_CONF_APP_MQTT_DEADBAND_PCT 0
+#endif
+
+// Longest time in ms a resource goes unreported, 0 disables the heartbeat
+#ifndef MBED_CONF_APP_MQTT_HEARTBEAT_MS
+#define MBED_CONF_APP_MQTT_HEARTBEAT_MS 300000
+#endif
+
+// Publish a summary (count, min, max, mean, standard deviation) of
+// the samples of each resource every mqtt-batch-period-ms instead
+// of the samples themselves
+#ifndef MBED_CONF_APP_MQTT_AGGREGATE
+#define MBED_CONF_APP_MQTT_AGGREGATE 0
+#endif
+
+// Publish telemetry as CBOR with integer keys instead of JSON
+#ifndef MBED_CONF_APP_MQTT_PAYLOAD_CBOR
+#define MBED_CONF_APP_MQTT_PAYLOAD_CBOR 0
+#endif
+
+// Time in ms between two collections of the new samples of the resources
+#define MQTT_SAMPLE_PERIOD_MS 2000
+
+#define MQTT_BATCH_MAX_RESOURCES 8
+
 class MQTTDataProvider{
  public:
      MQTTDataProvider( const char* aDeviceId,
      	               map<std::string, DeviceResource*>  aResources
                      ):
             deviceId(aDeviceId),
-            resources(aResources)
+            resources(aResources),
+            batchCount(0)
        {
+           for (size_t j = 0; j < MQTT_BATCH_MAX_RESOURCES; j++) {
+               batchLen[j] = 0;
+               cursors[j] = 0;
+               summaries[j].count = 0;
+               reports[j].absolute = MBED_CONF_APP_MQTT_DEADBAND_ABS;
+               reports[j].percent = MBED_CONF_APP_MQTT_DEADBAND_PCT;
+               reports[j].lastTime = 0;
+               reports[j].reported = false;
+           }
        }
 
     ~MQTTDataProvider(){}
 
     void run(NetworkInterface *net);
-    std::string getData(); //returns JSON as described here: https://confluence.arm.com/display/IoTBU/Message+Structure
+    void setDeadband(const char* path, float absolute, float percent); //overrides the default deadband of a resource
+    bool addSamples(); //adds the new samples that changed, or are due a heartbeat, to the batch, returns true once the batch is full
+    void addToSummaries(); //adds the new samples to the summary of each resource
+    int getPayload(char *buf, size_t size); //writes the batch or the summaries in the configured format, returns its length or -1 if it does not fit
+    int getData(char *buf, size_t size); //writes the batch as JSON as described here: https://confluence.arm.com/display/IoTBU/Message+Structure, returns its length or -1 if it does not fit
+    int getDataCbor(char *buf, size_t size); //writes the batch as CBOR, see getDataCbor(), returns its length or -1 if it does not fit
+    int getSummary(char *buf, size_t size); //writes the summaries as JSON, returns its length or -1 if it does not fit
+    int getSummaryCbor(char *buf, size_t size); //writes the summaries as CBOR, see getSummaryCbor(), returns its length or -1 if it does not fit
     std::string getDataOld(int counter); //returns JSON in format used in 1st demo with plotting
     void publish_data(std::string key, std::string value);
 
     const char* deviceId;
     map<std::string, DeviceResource*> resources;
 
+    // Samples waiting to be published, indexed by the position of the
+    // resource in the resources map, and where each resource's history
+    // was read up to
+    DeviceSample batch[MQTT_BATCH_MAX_RESOURCES][MBED_CONF_APP_MQTT_BATCH_SIZE];
+    int batchLen[MQTT_BATCH_MAX_RESOURCES];
+    int batchCount;
+    uint32_t cursors[MQTT_BATCH_MAX_RESOURCES];
+
+    // Running summary of the samples of each resource in the current
+    // interval, the mean and variance kept with Welford's method
+    struct Summary {
+        int count;
+        int32_t min, max;   // fixed point, as in the samples
+        double mean;
+        double m2;          // sum of squared differences from the mean
+        long long first, last;
+        uint8_t scale;
+        const char *unit;
+    };
+    Summary summaries[MQTT_BATCH_MAX_RESOURCES];
+
+    // Report-on-change state of each resource, same indexing
+    struct Report {
+        float absolute;     // deadband in the units of the value
+        float percent;      // deadband in percent of the last value
+        double last;        // last reported value
+        long long lastTime; // and when, ms since the epoch
+        bool reported;
+    };
+    Report reports[MQTT_BATCH_MAX_RESOURCES];
+
+    bool hasChanged(size_t j, const DeviceSample &sample);
+    void clearBatch();
+    void clearSummaries();
+
 };
 
 #endif
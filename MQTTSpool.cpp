@@ -0,0 +1,311 @@
+#include "MQTTSpool.h"
+
+namespace MQTT
+{
+
+int MQTTSpool::open()
+{
+    mutex.lock();
+
+    if (file == NULL)
+        file = fopen(path, "r+b");
+
+    if (file != NULL)
+    {
+        if (fseek(file, 0, SEEK_SET) != 0
+            || fread(&header, sizeof(header), 1, file) != 1
+            || header.magic != SPOOL_MAGIC
+            || header.capacity != capacity
+            || header.head >= capacity)
+        {
+            DBG("Spool [%s] unusable, starting a new one\r\n", path);
+            fclose(file);
+            file = NULL;
+        }
+    }
+
+    int rc = SUCCESS;
+    if (file == NULL)
+        rc = create();
+    else
+    {
+        recover();
+        printf("Spool [%s] holds %u messages\r\n", path, (unsigned int) records);
+    }
+
+    mutex.unlock();
+
+    return rc;
+}
+
+void MQTTSpool::close()
+{
+    mutex.lock();
+    if (file != NULL)
+    {
+        writeHeader();
+        fclose(file);
+        file = NULL;
+    }
+    mutex.unlock();
+}
+
+int MQTTSpool::create()
+{
+    static const unsigned char zeros[64] = {0};
+
+    file = fopen(path, "w+b");
+    if (file == NULL)
+    {
+        printf("Spool [%s] cannot be created\r\n", path);
+        return FAILURE;
+    }
+
+    // Sequence numbers start at 1, so the zeroed ring holds no record
+    header.magic = SPOOL_MAGIC;
+    header.capacity = capacity;
+    header.head = 0;
+    header.seq = 1;
+    used = 0;
+    records = 0;
+
+    // Allocate the whole file up front, so that appends never have to
+    // update the allocation table
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        return FAILURE;
+    for (size_t done = 0; done < capacity; done += sizeof(zeros))
+    {
+        size_t chunk = capacity - done;
+        if (chunk > sizeof(zeros))
+            chunk = sizeof(zeros);
+        if (fwrite(zeros, 1, chunk, file) != chunk)
+            return FAILURE;
+    }
+
+    return writeHeader();
+}
+
+/**
+ * Finds the records after the saved head, they carry consecutive
+ * sequence numbers up to the newest one.
+ **/
+void MQTTSpool::recover()
+{
+    RecordHeader rec;
+
+    used = 0;
+    records = 0;
+    while (readAt(header.head + used, &rec, sizeof(rec)) == SUCCESS
+           && rec.seq == header.seq + records
+           && rec.topiclen > 0)
+    {
+        size_t length = sizeof(rec) + rec.topiclen + rec.payloadlen;
+        if (used + length > capacity)
+            break;
+
+        used += length;
+        records++;
+    }
+    savedHead = header.head;
+    unsavedPops = 0;
+}
+
+int MQTTSpool::writeHeader()
+{
+    savedHead = header.head;
+    unsavedPops = 0;
+
+    if (fseek(file, 0, SEEK_SET) != 0
+        || fwrite(&header, sizeof(header), 1, file) != 1
+        || fflush(file) != 0)
+        return FAILURE;
+
+    return SUCCESS;
+}
+
+/**
+ * Reads length bytes at offset of the ring, wrapping around its end.
+ **/
+int MQTTSpool::readAt(uint32_t offset, void * buffer, size_t length)
+{
+    unsigned char * ptr = (unsigned char *) buffer;
+
+    while (length > 0)
+    {
+        offset %= capacity;
+        size_t chunk = capacity - offset;
+        if (chunk > length)
+            chunk = length;
+
+        if (fseek(file, sizeof(header) + offset, SEEK_SET) != 0
+            || fread(ptr, 1, chunk, file) != chunk)
+            return FAILURE;
+
+        ptr += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Writes length bytes at offset of the ring, wrapping around its end.
+ **/
+int MQTTSpool::writeAt(uint32_t offset, const void * buffer, size_t length)
+{
+    const unsigned char * ptr = (const unsigned char *) buffer;
+
+    while (length > 0)
+    {
+        offset %= capacity;
+        size_t chunk = capacity - offset;
+        if (chunk > length)
+            chunk = length;
+
+        if (fseek(file, sizeof(header) + offset, SEEK_SET) != 0
+            || fwrite(ptr, 1, chunk, file) != chunk)
+            return FAILURE;
+
+        ptr += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+
+    return SUCCESS;
+}
+
+void MQTTSpool::dropOldest()
+{
+    RecordHeader rec;
+
+    if (records == 0 || readAt(header.head, &rec, sizeof(rec)) != SUCCESS)
+    {
+        // Can't walk the records any more, forget them all
+        header.head = (header.head + used) % capacity;
+        header.seq += records;
+        used = 0;
+        records = 0;
+        return;
+    }
+
+    size_t length = sizeof(rec) + rec.topiclen + rec.payloadlen;
+    header.head = (header.head + length) % capacity;
+    header.seq++;
+    used -= length;
+    records--;
+}
+
+int MQTTSpool::append(const PubMessage & message)
+{
+    RecordHeader rec;
+    size_t topiclen = strlen(message.topic);
+
+    rec.qos = message.qos;
+    rec.topiclen = topiclen;
+    rec.payloadlen = message.payloadlen;
+
+    size_t length = sizeof(rec) + rec.topiclen + rec.payloadlen;
+    if (topiclen == 0 || topiclen > 0xFF || message.payloadlen > 0xFFFF || length > capacity)
+        return BUFFER_OVERFLOW;
+
+    mutex.lock();
+
+    int rc = FAILURE;
+    if (file != NULL)
+    {
+        // Make room by dropping the oldest records
+        while (used + length > capacity)
+        {
+            dropOldest();
+            dropped++;
+        }
+
+        // The file must not point at bytes about to be overwritten,
+        // this happens about once per trip round the ring
+        uint32_t tail = (header.head + used) % capacity;
+        rc = SUCCESS;
+        if ((savedHead + capacity - tail) % capacity < length)
+            rc = writeHeader();
+
+        // The record header goes last, a torn record then ends the
+        // walk in recover() instead of being taken for a whole one
+        rec.seq = header.seq + records;
+        if (rc == SUCCESS
+            && writeAt(tail + sizeof(rec), message.topic, rec.topiclen) == SUCCESS
+            && writeAt(tail + sizeof(rec) + rec.topiclen, message.payload, rec.payloadlen) == SUCCESS
+            && writeAt(tail, &rec, sizeof(rec)) == SUCCESS)
+        {
+            used += length;
+            records++;
+        }
+        else
+            rc = FAILURE;
+    }
+
+    mutex.unlock();
+
+    return rc;
+}
+
+int MQTTSpool::peek(PubMessage & message)
+{
+    RecordHeader rec;
+    int rc = FAILURE;
+
+    mutex.lock();
+
+    if (file != NULL && records > 0
+        && readAt(header.head, &rec, sizeof(rec)) == SUCCESS
+        && rec.topiclen < sizeof(message.topic)
+        && rec.payloadlen <= sizeof(message.payload)
+        && readAt(header.head + sizeof(rec), message.topic, rec.topiclen) == SUCCESS
+        && readAt(header.head + sizeof(rec) + rec.topiclen, message.payload, rec.payloadlen) == SUCCESS)
+    {
+        message.topic[rec.topiclen] = '\0';
+        message.qos = (QoS) rec.qos;
+        message.id = 0;
+        message.payloadlen = rec.payloadlen;
+        rc = SUCCESS;
+    }
+
+    mutex.unlock();
+
+    return rc;
+}
+
+void MQTTSpool::pop()
+{
+    mutex.lock();
+
+    if (file != NULL && records > 0)
+    {
+        dropOldest();
+        // An empty spool is saved at once, so that nothing is sent
+        // twice after a reboot once the backlog has gone out
+        if (records == 0 || ++unsavedPops >= SAVE_EVERY_POPS)
+            writeHeader();
+    }
+
+    mutex.unlock();
+}
+
+unsigned int MQTTSpool::count()
+{
+    mutex.lock();
+    unsigned int n = records;
+    mutex.unlock();
+
+    return n;
+}
+
+unsigned int MQTTSpool::droppedCount()
+{
+    mutex.lock();
+    unsigned int n = dropped;
+    mutex.unlock();
+
+    return n;
+}
+
+}
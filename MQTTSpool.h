@@ -0,0 +1,129 @@
+#ifndef _MQTT_SPOOL_H_
+#define _MQTT_SPOOL_H_
+
+#include "mbed.h"
+#include "rtos.h"
+#include "MQTTThreadedClient.h"
+#include "fs.h"
+
+#include <cstdio>
+
+// Path of the spool file on the application filesystem
+#ifndef MBED_CONF_APP_MQTT_SPOOL_PATH
+#define MBED_CONF_APP_MQTT_SPOOL_PATH FS_MOUNT_POINT "/mqtt.spl"
+#endif
+
+// Bytes of publish records the spool holds, 0 disables spooling
+#ifndef MBED_CONF_APP_MQTT_SPOOL_SIZE
+#define MBED_CONF_APP_MQTT_SPOOL_SIZE 65536
+#endif
+
+namespace MQTT
+{
+
+/**
+ * Persistent store-and-forward spool for outgoing publishes.
+ *
+ * Records are kept in a single file used as a ring buffer of
+ * capacity bytes, after a small header holding the read cursor.
+ * Each record is a sequence number, the QoS, the topic and payload
+ * lengths followed by the topic and the payload, so a spooled
+ * message costs only a few bytes more than its contents. When the
+ * ring is full the oldest records are dropped to make room.
+ *
+ * The filesystem has no wear levelling, so the header is not
+ * rewritten for every record. It is saved before an append would
+ * overwrite the record it points at, after every few pops and when
+ * the spool empties. Opening the spool walks the records from the
+ * saved cursor for as long as their sequence numbers follow on, which
+ * finds the records appended since. Records popped since the last
+ * save are sent again after a reboot.
+ **/
+class MQTTSpool
+{
+public:
+    MQTTSpool(const char * aPath = MBED_CONF_APP_MQTT_SPOOL_PATH, size_t aCapacity = MBED_CONF_APP_MQTT_SPOOL_SIZE)
+        : path(aPath),
+          capacity(aCapacity),
+          file(NULL),
+          used(0),
+          records(0),
+          savedHead(0),
+          unsavedPops(0),
+          dropped(0)
+    {
+        memset(&header, 0, sizeof(header));
+    }
+
+    ~MQTTSpool()
+    {
+        close();
+    }
+
+    /**
+     *  Opens the spool file, keeping the records of an earlier run,
+     *  or creates an empty one if it is missing or was created with
+     *  a different capacity. The filesystem must be mounted.
+     */
+    int open();
+    void close();
+
+    /**
+     *  Appends a message at the end of the spool.
+     */
+    int append(const PubMessage & message);
+    /**
+     *  Reads the oldest record into message without removing it,
+     *  returns FAILURE if the spool is empty.
+     */
+    int peek(PubMessage & message);
+    /**
+     *  Removes the oldest record, once it has been sent.
+     */
+    void pop();
+
+    unsigned int count();
+    unsigned int droppedCount();
+
+private:
+    static const uint32_t SPOOL_MAGIC = 0x324C5053; // "SPL2"
+    // Pops between two saves of the header
+    static const unsigned int SAVE_EVERY_POPS = 16;
+
+    typedef struct
+    {
+        uint32_t magic;
+        uint32_t capacity;
+        uint32_t head;      // offset of the oldest record
+        uint32_t seq;       // its sequence number
+    } SpoolHeader;
+
+    typedef struct
+    {
+        uint32_t seq;
+        uint8_t qos;
+        uint8_t topiclen;
+        uint16_t payloadlen;
+    } RecordHeader;
+
+    const char * path;
+    size_t capacity;
+    FILE * file;
+    SpoolHeader header;
+    uint32_t used;          // bytes of records after head
+    uint32_t records;       // number of records
+    uint32_t savedHead;     // head as last written to the file
+    unsigned int unsavedPops;
+    unsigned int dropped;
+    Mutex mutex;
+
+    int create();
+    void recover();
+    int writeHeader();
+    int readAt(uint32_t offset, void * buffer, size_t length);
+    int writeAt(uint32_t offset, const void * buffer, size_t length);
+    void dropOldest();
+};
+
+}
+#endif
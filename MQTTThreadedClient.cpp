@@ -1,28 +1,25 @@
 #include "mbed.h"
 #include "rtos.h"
 #include "MQTTThreadedClient.h"
+#include "MQTTSpool.h"
 #include "mbedtls/platform.h"
 #include "mbedtls/ssl.h"
 #include "mbedtls/entropy.h"
 #include "mbedtls/ctr_drbg.h"
 #include "mbedtls/error.h"
+#include "mbedtls/gcm.h"
+#if MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+#include "keystore.h"
+
+// The encrypted TLS session is persisted in a store of its own, so
+// that writing it from the listener thread can never race with the
+// application rewriting the main keystore
+#define TLS_SESSION_KEYSTORE_PATH "/mqtt/session.data"
+#define TLS_SESSION_KEYSTORE_KEY "mqtt_tls_session"
+// HKDF label of the key the session is encrypted with
+#define TLS_SESSION_KEY_LABEL "mqtt-session"
+#endif
 
-#define QUEUE_SIZE 2
-static MemoryPool<MQTT::PubMessage, 2* QUEUE_SIZE> mpool; // 2nd arg is the number of elements in pool
-static Queue<MQTT::PubMessage, QUEUE_SIZE> mqueue;     // 2nd arg is the number of elements in queue
-
-//https://os.mbed.com/docs/v5.8/mbed-os-api-doxy/classrtos_1_1_queue.html
-
-
-// SSL/TLS variables
-mbedtls_entropy_context _entropy;
-mbedtls_ctr_drbg_context _ctr_drbg;
-mbedtls_x509_crt _cacert;
-mbedtls_x509_crt _clientcert;
-mbedtls_pk_context _pkey;
-mbedtls_ssl_context _ssl;
-mbedtls_ssl_config _ssl_conf;    
-mbedtls_ssl_session saved_session;
 
 bool _debug = false;
 
@@ -35,7 +32,6 @@ static int ssl_recv(void *ctx, unsigned char *buf, size_t len)
 {
     int recv = -1;
     TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-    socket->set_timeout(DEFAULT_SOCKET_TIMEOUT);
     recv = socket->recv(buf, len);
 
     if (NSAPI_ERROR_WOULD_BLOCK == recv) {
@@ -54,7 +50,6 @@ static int ssl_send(void *ctx, const unsigned char *buf, size_t len)
 {
     int sent = -1;
     TCPSocket *socket = static_cast<TCPSocket *>(ctx);
-    socket->set_timeout(DEFAULT_SOCKET_TIMEOUT);    
     sent = socket->send(buf, len);
 
     if(NSAPI_ERROR_WOULD_BLOCK == sent) {
@@ -115,19 +110,134 @@ static int my_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *fla
 }
 #endif
 
+/**
+ * Certificate verification callback for mbed TLS
+ * The server only sends its certificate on a full handshake, so this
+ * flags that the handshake in progress was not a resumed one.
+ */
+static int ssl_verify(void *data, mbedtls_x509_crt *crt, int depth, uint32_t *flags)
+{
+    bool *certVerified = static_cast<bool *>(data);
+    *certVerified = true;
+
+#if DEBUG_LEVEL > 0
+    return my_verify(NULL, crt, depth, flags);
+#else
+    (void) crt;
+    (void) depth;
+    (void) flags;
+    return 0;
+#endif
+}
+
+#if MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+// Version of the persisted session layout
+#define TLS_SESSION_BLOB_VERSION 1
+// Largest session ticket that is persisted
+#define TLS_SESSION_MAX_TICKET 512
+#define TLS_SESSION_BLOB_SIZE (1 + 4 + 4 + 1 + 32 + 48 + 4 + 4 + 2 + TLS_SESSION_MAX_TICKET)
+#define TLS_SESSION_IV_SIZE 12
+#define TLS_SESSION_TAG_SIZE 16
+
+static unsigned char *putUint32(unsigned char *ptr, uint32_t value)
+{
+    *ptr++ = (value >> 24) & 0xFF;
+    *ptr++ = (value >> 16) & 0xFF;
+    *ptr++ = (value >> 8) & 0xFF;
+    *ptr++ = value & 0xFF;
+    return ptr;
+}
+
+static const unsigned char *getUint32(const unsigned char *ptr, uint32_t *value)
+{
+    *value = ((uint32_t) ptr[0] << 24) | ((uint32_t) ptr[1] << 16) | ((uint32_t) ptr[2] << 8) | ptr[3];
+    return ptr + 4;
+}
+
+/**
+ * Flattens the parts of a session needed to resume it. The peer
+ * certificate is left out, it was verified when the session was made.
+ */
+static size_t sessionToBlob(const mbedtls_ssl_session *session, unsigned char *blob)
+{
+    unsigned char *ptr = blob;
+
+    *ptr++ = TLS_SESSION_BLOB_VERSION;
+    ptr = putUint32(ptr, session->ciphersuite);
+    ptr = putUint32(ptr, session->compression);
+    *ptr++ = session->id_len;
+    memcpy(ptr, session->id, 32);
+    ptr += 32;
+    memcpy(ptr, session->master, 48);
+    ptr += 48;
+    ptr = putUint32(ptr, session->verify_result);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    size_t ticket_len = (session->ticket != NULL && session->ticket_len <= TLS_SESSION_MAX_TICKET) ? session->ticket_len : 0;
+    ptr = putUint32(ptr, session->ticket_lifetime);
+    *ptr++ = (ticket_len >> 8) & 0xFF;
+    *ptr++ = ticket_len & 0xFF;
+    memcpy(ptr, session->ticket, ticket_len);
+    ptr += ticket_len;
+#endif
+
+    return ptr - blob;
+}
+
+static bool sessionFromBlob(mbedtls_ssl_session *session, const unsigned char *blob, size_t len)
+{
+    const unsigned char *ptr = blob;
+    uint32_t value;
+
+    if (len < 1 + 4 + 4 + 1 + 32 + 48 + 4 || *ptr++ != TLS_SESSION_BLOB_VERSION)
+        return false;
+
+    ptr = getUint32(ptr, &value);
+    session->ciphersuite = value;
+    ptr = getUint32(ptr, &value);
+    session->compression = value;
+    session->id_len = *ptr++;
+    if (session->id_len > 32)
+        return false;
+    memcpy(session->id, ptr, 32);
+    ptr += 32;
+    memcpy(session->master, ptr, 48);
+    ptr += 48;
+    ptr = getUint32(ptr, &value);
+    session->verify_result = value;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    if ((size_t) (ptr - blob) + 4 + 2 > len)
+        return false;
+    ptr = getUint32(ptr, &value);
+    session->ticket_lifetime = value;
+    size_t ticket_len = (ptr[0] << 8) | ptr[1];
+    ptr += 2;
+    if ((size_t) (ptr - blob) + ticket_len > len)
+        return false;
+    if (ticket_len > 0)
+    {
+        session->ticket = (unsigned char *) calloc(1, ticket_len);
+        if (session->ticket == NULL)
+            return false;
+        memcpy(session->ticket, ptr, ticket_len);
+    }
+    session->ticket_len = ticket_len;
+#endif
+
+    return true;
+}
+#endif
+
 
 void MQTTThreadedClient::setupTLS()    
 {
         if (useTLS)
         {
+            credentials->retain();
             mbedtls_entropy_init(&_entropy);
             mbedtls_ctr_drbg_init(&_ctr_drbg);
-            mbedtls_x509_crt_init(&_cacert);
-            mbedtls_x509_crt_init(&_clientcert); 
-            mbedtls_pk_init(&_pkey ); 
             mbedtls_ssl_init(&_ssl);
             mbedtls_ssl_config_init(&_ssl_conf);        
-            memset( &saved_session, 0, sizeof( mbedtls_ssl_session ) );            
+            mbedtls_ssl_session_init(&saved_session);
         }    
 }
 
@@ -137,18 +247,15 @@ void MQTTThreadedClient::freeTLS()
         {
             mbedtls_entropy_free(&_entropy);
             mbedtls_ctr_drbg_free(&_ctr_drbg);
-            mbedtls_x509_crt_free(&_cacert);
-            mbedtls_x509_crt_free(&_clientcert);
-            mbedtls_pk_free(&_pkey);
             mbedtls_ssl_free(&_ssl);
             mbedtls_ssl_config_free(&_ssl_conf);               
+            mbedtls_ssl_session_free(&saved_session);
         }    
 }
 
 int MQTTThreadedClient::initTLS()
 {
         int ret;
-        size_t len;
 
         DBG("MQTTThreadedClient::initTLS() ...\r\n");
         DBG("1)-->  mbedtls_ctr_drdbg_seed ...\r\n");
@@ -162,71 +269,15 @@ int MQTTThreadedClient::initTLS()
             return -1;
         }
 
-        if (isDERformat) {
-          DBG("2)-->DER mbedtls_x509_crt_parse ca cert ...\r\n");
-
-          //len = strlen((const char*)ssl_ca);
-          len = ssl_ca_len; // 569; //sizeof(ssl_ca);
-          mbedtls_printf("len=%d \r\n", len);
-
-          if ((ret = mbedtls_x509_crt_parse_der(&_cacert, (const unsigned char *) ssl_ca,
-                           len + 1)) != 0) {
-            mbedtls_printf("ERROR mbedtls_x509_crt_parse_der() ca cert returned [%x]\r\n", ret);
-            mbedtls_printf("%s \r\n", (const unsigned char *) ssl_ca);
-            _error = ret;
-            return -1;
-          }
-
-          DBG("3)-->DER mbedtls_x509_crt_parse client cert ...\r\n");
-          len = ssl_client_cert_len; // strlen((const char*)ssl_client_cert);
-          if ((ret = mbedtls_x509_crt_parse_der(&_clientcert, (const unsigned char *) ssl_client_cert,
-                           len + 1)) != 0) {
-            mbedtls_printf("ERROR mbedtls_x509_crt_parse_der() client cert returned [%x]\r\n", ret);
-            mbedtls_printf("%s \r\n", (const unsigned char *) ssl_client_cert);
-            _error = ret;
-            return -1;
-          }
-
-        } else {  // PEM
-
-          DBG("2)-->PEM mbedtls_x509_crt_parse ca cert ...\r\n");
-          len = strlen((const char*)ssl_ca);
-          if ((ret = mbedtls_x509_crt_parse(&_cacert, (const unsigned char *) ssl_ca,
-                           len + 1 )) != 0) {
-            mbedtls_printf("mbedtls_x509_crt_parse ca cert returned [%x]\r\n", ret);
-            mbedtls_printf("%s \r\n", (const unsigned char *) ssl_ca);
-            _error = ret;
-            return -1;
-          }
-
-          DBG("3)-->PEM mbedtls_x509_crt_parse client cert ...\r\n");
-          len = strlen((const char*)ssl_client_cert);
-          if ((ret = mbedtls_x509_crt_parse(&_clientcert, (const unsigned char *) ssl_client_cert,
-                           len + 1)) != 0) {
-            mbedtls_printf("mbedtls_x509_crt_parse client cert returned [%x]\r\n", ret);
-            mbedtls_printf("%s \r\n", (const unsigned char *) ssl_client_cert);
-            _error = ret;
-            return -1;
-          }
-
-        }  // end of PEM
-
-        DBG("4)-->PEM or DER  mbedtls_pk_parse_key ...\r\n");
-        if (isDERformat)
-            len = ssl_client_pkey_len;
-        else
-            len = strlen((const char*)ssl_client_pkey);
-
-        if ((ret = mbedtls_pk_parse_key(&_pkey, (const unsigned char *) ssl_client_pkey,
-                           len + 1, NULL, 0)) != 0) {
-            mbedtls_printf("mbedtls_pk_parse_key returned [%x]\r\n", ret);
-            mbedtls_printf("%s \r\n", (const unsigned char *) ssl_client_pkey);
+        // Only the first client to get here parses the credentials,
+        // the others and every reconnect reuse them
+        DBG("2)--> parse credentials ...\r\n");
+        if ((ret = credentials->parse()) != 0) {
             _error = ret;
             return -1;
         }
 
-
-        DBG("5) --> mbedtls_ssl_config_defaults ...\r\n");
+        DBG("3) --> mbedtls_ssl_config_defaults ...\r\n");
         if ((ret = mbedtls_ssl_config_defaults(&_ssl_conf,
                         MBEDTLS_SSL_IS_CLIENT,
                         MBEDTLS_SSL_TRANSPORT_STREAM,
@@ -237,17 +288,14 @@ int MQTTThreadedClient::initTLS()
         }
 
         DBG("mbedtls_ssl_config_ca_chain ...\r\n");
-        mbedtls_ssl_conf_ca_chain(&_ssl_conf, &_cacert, NULL);
+        mbedtls_ssl_conf_ca_chain(&_ssl_conf, credentials->caChain(), NULL);
         DBG("mbedtls_ssl_conf_rng ...\r\n");
         mbedtls_ssl_conf_rng(&_ssl_conf, mbedtls_ctr_drbg_random, &_ctr_drbg);
 
-
-        mbedtls_ssl_conf_ca_chain(&_ssl_conf, &_cacert, NULL);
-    
         ret = mbedtls_ssl_conf_own_cert( 
             &_ssl_conf,   //SSL conf
-            &_clientcert,    //own public cert chain
-            &_pkey        //own private key
+            credentials->ownCert(),    //own public cert chain
+            credentials->ownKey()        //own private key
         );
         if (ret != 0) {
             mbedtls_printf("mbedtls_ssl_conf_own_cert() returned -0x%04X\n", -ret);
@@ -260,8 +308,12 @@ int MQTTThreadedClient::initTLS()
         DBG("mbedtls_ssl_conf_authmode ...\r\n");         
         mbedtls_ssl_conf_authmode(&_ssl_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
 
+        mbedtls_ssl_conf_verify(&_ssl_conf, ssl_verify, &certVerified);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        mbedtls_ssl_conf_session_tickets(&_ssl_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+
 #if DEBUG_LEVEL > 0
-        mbedtls_ssl_conf_verify(&_ssl_conf, my_verify, NULL);
         mbedtls_ssl_conf_dbg(&_ssl_conf, my_debug, NULL);
         mbedtls_debug_set_threshold(DEBUG_LEVEL);
 #endif
@@ -272,6 +324,14 @@ int MQTTThreadedClient::initTLS()
             _error = ret;
             return -1;
         }
+
+#if MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+        // The persisted session is encrypted with a key only this
+        // device has, derived from its private key
+        hasSessionKey = (credentials->deriveKey(TLS_SESSION_KEY_LABEL, sessionKey) == 0);
+        if (hasSessionKey)
+            loadSession();
+#endif
         
         return 0;
 }
@@ -282,9 +342,12 @@ int MQTTThreadedClient::doTLSHandshake()
         
         /* Start the handshake, the rest will be done in onReceive() */
         printf("Starting the TLS handshake...\r\n");
+        tcpSocket->set_timeout(DEFAULT_SOCKET_TIMEOUT);
+        certVerified = false;
         ret = mbedtls_ssl_handshake(&_ssl);
         if (ret < 0) 
         {
+            tlsStats.failedHandshakes++;
             if (ret != MBEDTLS_ERR_SSL_WANT_READ &&
                 ret != MBEDTLS_ERR_SSL_WANT_WRITE) 
                     mbedtls_printf("mbedtls_ssl_handshake returned [%x]\r\n", ret);
@@ -297,15 +360,19 @@ int MQTTThreadedClient::doTLSHandshake()
         }
 
         /* Handshake done, time to print info */
-        printf("TLS connection to %s:%d established\r\n", 
-            host.c_str(), port);
+        printf("TLS connection to %s:%d established (%s handshake)\r\n", 
+            host.c_str(), port, certVerified ? "full" : "resumed");
 
         const uint32_t buf_size = 1024;
         char *buf = new char[buf_size];
-        mbedtls_x509_crt_info(buf, buf_size, "\r    ",
-                        mbedtls_ssl_get_peer_cert(&_ssl));
-                        
-        printf("Server certificate:\r\n%s\r", buf);
+        // A resumed session carries no server certificate to show
+        if (certVerified)
+        {
+            mbedtls_x509_crt_info(buf, buf_size, "\r    ",
+                            mbedtls_ssl_get_peer_cert(&_ssl));
+                            
+            printf("Server certificate:\r\n%s\r", buf);
+        }
         // Verify server cert ...
         uint32_t flags = mbedtls_ssl_get_verify_result(&_ssl);
         if( flags != 0 )
@@ -314,23 +381,37 @@ int MQTTThreadedClient::doTLSHandshake()
             printf("Certificate verification failed:\r\n%s\r\r\n", buf);
             // free server cert ... before error return
             delete [] buf;
+            tlsStats.failedHandshakes++;
             return -1;
         }
         
         printf("Certificate verification passed\r\n\r\n");
         // delete server cert after verification
         delete [] buf;
+
+        if (certVerified)
+            tlsStats.fullHandshakes++;
+        else
+            tlsStats.resumedHandshakes++;
         
 #if defined(MBEDTLS_SSL_CLI_C)        
-				printf("Saving SSL/TLS session ...\r\n");
-        // TODO: Save the session here for reconnect.
+        // Keep the session in RAM so the next connect can resume it.
+        // mbedtls_ssl_get_session() allocates into the copy, free the
+        // previous one first.
+        mbedtls_ssl_session_free(&saved_session);
         if( ( ret = mbedtls_ssl_get_session( &_ssl, &saved_session ) ) != 0 )
         {
             mbedtls_printf( "mbedtls_ssl_get_session returned -0x%x\n\n", -ret );
             hasSavedSession = false;
             return -1;
         }  
-        printf("Session saved for reconnect ...\r\n");				
+        DBG("Session saved for reconnect ...\r\n");
+
+#if MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+        // Only a new session is worth the flash write
+        if (certVerified && hasSessionKey)
+            persistSession();
+#endif
 #endif        
      
         hasSavedSession = true;
@@ -338,6 +419,105 @@ int MQTTThreadedClient::doTLSHandshake()
         return 0;
 }
 
+#if MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+/**
+ * Loads the session persisted by an earlier run from the keystore, so
+ * that the first connection after a reboot can be resumed too.
+ **/
+void MQTTThreadedClient::loadSession()
+{
+    Keystore k(TLS_SESSION_KEYSTORE_PATH);
+    unsigned char *data;
+    unsigned char blob[TLS_SESSION_BLOB_SIZE];
+    mbedtls_gcm_context gcm;
+
+    if (k.open() != 0)
+        return;
+
+    std::string hex = k.get(TLS_SESSION_KEYSTORE_KEY);
+    size_t len = hex.length() / 2;
+    if (len <= TLS_SESSION_IV_SIZE + TLS_SESSION_TAG_SIZE
+        || len > TLS_SESSION_IV_SIZE + TLS_SESSION_TAG_SIZE + TLS_SESSION_BLOB_SIZE)
+        return;
+
+    data = new unsigned char[len];
+    for (size_t i = 0; i < len; i++)
+        data[i] = strtoul(hex.substr(2 * i, 2).c_str(), NULL, 16);
+
+    // iv | tag | encrypted session
+    size_t blob_len = len - TLS_SESSION_IV_SIZE - TLS_SESSION_TAG_SIZE;
+    mbedtls_gcm_init(&gcm);
+    int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, sessionKey, 256);
+    if (ret == 0)
+        ret = mbedtls_gcm_auth_decrypt(&gcm, blob_len, data, TLS_SESSION_IV_SIZE, NULL, 0,
+                                       data + TLS_SESSION_IV_SIZE, TLS_SESSION_TAG_SIZE,
+                                       data + TLS_SESSION_IV_SIZE + TLS_SESSION_TAG_SIZE, blob);
+    mbedtls_gcm_free(&gcm);
+    delete [] data;
+
+    mbedtls_ssl_session_free(&saved_session);
+    if (ret == 0 && sessionFromBlob(&saved_session, blob, blob_len))
+    {
+        mbedtls_printf("Loaded the persisted TLS session\r\n");
+        hasSavedSession = true;
+    }
+    else
+    {
+        DBG("Persisted TLS session unusable [%x]\r\n", ret);
+        mbedtls_ssl_session_free(&saved_session);
+    }
+    memset(blob, 0, sizeof(blob));
+}
+
+/**
+ * Encrypts the current session and stores it in the keystore.
+ **/
+void MQTTThreadedClient::persistSession()
+{
+    Keystore k(TLS_SESSION_KEYSTORE_PATH);
+    unsigned char *data;
+    mbedtls_gcm_context gcm;
+    unsigned char blob[TLS_SESSION_BLOB_SIZE];
+    size_t blob_len = sessionToBlob(&saved_session, blob);
+    size_t len = TLS_SESSION_IV_SIZE + TLS_SESSION_TAG_SIZE + blob_len;
+
+    data = new unsigned char[len];
+    int ret = mbedtls_ctr_drbg_random(&_ctr_drbg, data, TLS_SESSION_IV_SIZE);
+    mbedtls_gcm_init(&gcm);
+    if (ret == 0)
+        ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, sessionKey, 256);
+    if (ret == 0)
+        ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, blob_len, data, TLS_SESSION_IV_SIZE, NULL, 0,
+                                        blob, data + TLS_SESSION_IV_SIZE + TLS_SESSION_TAG_SIZE,
+                                        TLS_SESSION_TAG_SIZE, data + TLS_SESSION_IV_SIZE);
+    mbedtls_gcm_free(&gcm);
+    memset(blob, 0, sizeof(blob));
+
+    if (ret == 0 && k.open() == 0)
+    {
+        std::string hex;
+        char byte[3];
+        for (size_t i = 0; i < len; i++)
+        {
+            snprintf(byte, sizeof(byte), "%02x", data[i]);
+            hex += byte;
+        }
+        k.set(TLS_SESSION_KEYSTORE_KEY, hex.c_str());
+        k.write();
+        DBG("TLS session persisted ...\r\n");
+    }
+    else
+        mbedtls_printf("Persisting the TLS session failed [%x]\r\n", ret);
+
+    delete [] data;
+}
+#endif
+
+TLSStats MQTTThreadedClient::getTLSStats()
+{
+    return tlsStats;
+}
+
 int MQTTThreadedClient::readBytesToBuffer(char * buffer, size_t size, int timeout)
 {
     int rc;
@@ -345,6 +525,10 @@ int MQTTThreadedClient::readBytesToBuffer(char * buffer, size_t size, int timeou
     if (tcpSocket == NULL)
         return -1;
 
+    // The socket timeout applies to the underlying recv
+    // for both plain and SSL/TLS connections
+    tcpSocket->set_timeout(timeout);
+
     if (useTLS) 
     {
         // Do SSL/TLS read
@@ -354,8 +538,6 @@ int MQTTThreadedClient::readBytesToBuffer(char * buffer, size_t size, int timeou
         else
             return rc;
     } else {
-        // non-blocking socket ...
-        tcpSocket->set_timeout(timeout);
         rc = tcpSocket->recv( (void *) buffer, size);
 
         // return 0 bytes if timeout ...
@@ -373,6 +555,9 @@ int MQTTThreadedClient::sendBytesFromBuffer(char * buffer, size_t size, int time
     if (tcpSocket == NULL)
         return -1;
     
+    // set the write timeout
+    tcpSocket->set_timeout(timeout);
+
     if (useTLS) {
         // Do SSL/TLS write
         rc =  mbedtls_ssl_write(&_ssl, (const unsigned char *) buffer, size);
@@ -381,9 +566,6 @@ int MQTTThreadedClient::sendBytesFromBuffer(char * buffer, size_t size, int time
         else
             return rc;
     } else {
-
-        // set the write timeout
-        tcpSocket->set_timeout(timeout);
         rc = tcpSocket->send(buffer, size);
 
         if ( NSAPI_ERROR_WOULD_BLOCK == rc)
@@ -431,13 +613,22 @@ exit:
 }
 
 int MQTTThreadedClient::sendPacket(size_t length)
+{
+    return sendAll(sendbuf, length);
+}
+
+/**
+ * Writes length bytes from buffer to the connection, looping
+ * until everything has been written or an error occurs.
+ **/
+int MQTTThreadedClient::sendAll(const unsigned char * buffer, size_t length)
 {
     int rc = FAILURE;
     size_t sent = 0;
 
     while (sent < length)
     {
-        rc = sendBytesFromBuffer((char *) &sendbuf[sent], length - sent, DEFAULT_SOCKET_TIMEOUT);
+        rc = sendBytesFromBuffer((char *) &buffer[sent], length - sent, DEFAULT_SOCKET_TIMEOUT);
         if (rc < 0)  // there was an error writing the data
             break;
         sent += rc;
@@ -450,10 +641,51 @@ int MQTTThreadedClient::sendPacket(size_t length)
         
     return rc;
 }
+/**
+ * Reads length bytes from the connection into buffer, looping
+ * until everything has been read or an error occurs.
+ **/
+int MQTTThreadedClient::readAll(unsigned char * buffer, size_t length)
+{
+    size_t received = 0;
+
+    while (received < length)
+    {
+        int rc = readBytesToBuffer((char *) &buffer[received], length - received, DEFAULT_SOCKET_TIMEOUT);
+        if (rc <= 0)
+            return (rc == TIMEOUT) ? TIMEOUT : FAILURE;
+        received += rc;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Reads and drops length bytes, used to skip packets
+ * too large for readbuf while keeping the stream in sync.
+ **/
+int MQTTThreadedClient::discardBytes(size_t length)
+{
+    while (length > 0)
+    {
+        size_t chunk = (length < sizeof(readbuf)) ? length : sizeof(readbuf);
+        if (readAll(readbuf, chunk) != SUCCESS)
+            return FAILURE;
+        length -= chunk;
+    }
+
+    return SUCCESS;
+}
+
 /**
  * Reads the entire packet to readbuf and returns
  * the type of packet when successful, otherwise
  * a negative error code is returned.
+ *
+ * A PUBLISH too large for readbuf is only read as far as it fits,
+ * readPending is then set to the number of payload bytes still
+ * to be read by handlePublishMsg(). Any other packet that does
+ * not fit is dropped and BUFFER_OVERFLOW returned.
  **/
 int MQTTThreadedClient::readPacket()
 {
@@ -461,31 +693,70 @@ int MQTTThreadedClient::readPacket()
     MQTTHeader header = {0};
     int len = 0;
     int rem_len = 0;
+    int avail = 0;
 
-    /* 1. read the header byte.  This has the packet type in it */
-    if ( (rc = readBytesToBuffer((char *) &readbuf[0], 1, DEFAULT_SOCKET_TIMEOUT)) != 1)
+    readPending = 0;
+
+    /* 1. read the header byte.  This has the packet type in it. The
+     *    listener only calls us when data may be there, so do not wait. */
+    if ( (rc = readBytesToBuffer((char *) &readbuf[0], 1, 0)) != 1)
+    {
+        if (rc != TIMEOUT)
+            rc = FAILURE;
         goto exit;
+    }
 
     len = 1;
     /* 2. read the remaining length.  This is variable in itself */
     if ( readPacketLength(&rem_len) < 0 )
+    {
+        rc = FAILURE;
         goto exit;
+    }
         
     len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
+    header.byte = readbuf[0];
+    avail = (int) sizeof(readbuf) - len;
 
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+    if (rem_len > avail)
     {
-        rc = BUFFER_OVERFLOW;
+        if (header.bits.type != PUBLISH)
+        {
+            DBG("Dropping packet type [%d] of %d bytes ...\r\n", header.bits.type, rem_len);
+            rc = (discardBytes(rem_len) == SUCCESS) ? BUFFER_OVERFLOW : FAILURE;
+            goto exit;
+        }
+
+        /* 3a. read the start of the PUBLISH, the topic must fit */
+        if (readAll(readbuf + len, avail) != SUCCESS)
+        {
+            rc = FAILURE;
+            goto exit;
+        }
+
+        int topic_len = (readbuf[len] << 8) + readbuf[len + 1];
+        int var_len = 2 + topic_len + ((header.bits.qos > 0) ? 2 : 0);
+        if (var_len >= avail)
+        {
+            DBG("Dropping PUBLISH with %d byte topic ...\r\n", topic_len);
+            rc = (discardBytes(rem_len - avail) == SUCCESS) ? BUFFER_OVERFLOW : FAILURE;
+            goto exit;
+        }
+
+        readPending = rem_len - avail;
+        rc = PUBLISH;
         goto exit;
     }
 
     /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (readBytesToBuffer((char *) (readbuf + len), rem_len, DEFAULT_SOCKET_TIMEOUT) != rem_len))
+    if (rem_len > 0 && readAll(readbuf + len, rem_len) != SUCCESS)
+    {
+        rc = FAILURE;
         goto exit;
+    }
 
     // Convert the header to type
     // and update rc
-    header.byte = readbuf[0];
     rc = header.bits.type;
     
 exit:
@@ -505,6 +776,18 @@ int MQTTThreadedClient::readUntil(int packetType, int timeout)
     timer.start();
     do {
         pType = readPacket();
+        if (pType == TIMEOUT)
+        {
+            // Nothing there yet, wait for the socket
+            int remaining = timeout - timer.read_ms();
+            if (remaining <= 0)
+            {
+                pType = FAILURE;
+                break;
+            }
+            listenerFlags.wait_any(MQTT_FLAG_SOCKET, remaining);
+            continue;
+        }
         if (pType < 0)
             break;
             
@@ -524,12 +807,6 @@ int MQTTThreadedClient::login()
     int rc = FAILURE;
     int len = 0;
 
-    if (!isConnected)
-    {
-        DBG("Session not connected! \r\n");
-        return rc;
-    }
-        
     // Copy the keepAliveInterval value to local
     // MQTT specifies in seconds, we have to multiply that
     // amount for our 32 bit timers which accepts ms.
@@ -537,7 +814,7 @@ int MQTTThreadedClient::login()
     
 
     
-    if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &connect_options)) <= 0)
+    if ((len = MQTTSerialize_connect(sendbuf, sizeof(sendbuf), &connect_options)) <= 0)
     {
         DBG("Error serializing connect packet ...\r\n");
         return rc;
@@ -552,10 +829,13 @@ int MQTTThreadedClient::login()
     if (readUntil(CONNACK, COMMAND_TIMEOUT) == CONNACK)
     {
         unsigned char connack_rc = 255;
-        bool sessionPresent = false;
+        unsigned char present = 0;
         DBG("Connection acknowledgement received ... deserializing respones ...\r\n");
-        if (MQTTDeserialize_connack((unsigned char*)&sessionPresent, &connack_rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (MQTTDeserialize_connack(&present, &connack_rc, readbuf, sizeof(readbuf)) == 1)
+        {
             rc = connack_rc;
+            sessionPresent = (present != 0);
+        }
         else
             rc = FAILURE;
     }
@@ -566,6 +846,11 @@ int MQTTThreadedClient::login()
     {
         DBG("Connected!!! ... starting connection timers ...\r\n");
         resetConnectionTimer();
+        // Only now do publishes stop going to the spool,
+        // enqueueMessage() reads this under outMutex
+        outMutex.lock();
+        isConnected = true;
+        outMutex.unlock();
     }
     
     DBG("Returning with rc = %d\r\n", rc);
@@ -585,9 +870,13 @@ void MQTTThreadedClient::disconnect()
             DBG( "disconnect(): Session reset returned an error \r\n");
         }        
         
+        outMutex.lock();
         isConnected = false;
-        tcpSocket->close();      
+        outMutex.unlock();
     }
+
+    // Also after a failed connect, so the same socket can be opened again
+    tcpSocket->close();
 }
 
 int MQTTThreadedClient::connect()
@@ -627,6 +916,7 @@ int MQTTThreadedClient::connect()
     }
         
     tcpSocket->open(network);
+    tcpSocket->sigio(mbed::callback(this, &MQTTThreadedClient::onSocketEvent));
     if (useTLS)
     {
         DBG("connect() mbedtls_ssl_set_hostname ...\r\n");         
@@ -638,12 +928,25 @@ int MQTTThreadedClient::connect()
     
     DBG("connect() attempting socket connect ...\r\n");         
     
-    if (( ret = tcpSocket->connect(host.c_str(), port)) < 0 )
+    // Skip the DNS lookup when reconnecting to a known address
+    if (!hostResolved)
+    {
+        if (( ret = network->gethostbyname(host.c_str(), &hostAddress)) < 0 )
+        {
+            DBG("connect() Error resolving %s with %d\r\n", host.c_str(), ret);
+            return ret;
+        }
+        hostAddress.set_port(port);
+        hostResolved = true;
+    }
+
+    if (( ret = tcpSocket->connect(hostAddress)) < 0 )
     {
          DBG("connect() Error connecting to %s:%d with %d\r\n", host.c_str(), port, ret);
+         // The broker may have moved, look it up again next time
+         hostResolved = false;
          return ret;
-    } else
-         isConnected = true;
+    }
     DBG("connect() done socket connect ...\r\n");         
     
     if (useTLS) 
@@ -665,188 +968,1029 @@ void MQTTThreadedClient::setConnectionParameters(const char * chost, uint16_t cp
     // Copy the settings for reconnection
     host = chost;
     port = cport;
+    hostResolved = false;
     connect_options = options;    
 }
 
 int MQTTThreadedClient::publish(PubMessage& msg)
 {
-#if 0
-    int id = queue.call(mbed::callback(this, &MQTTThreadedClient::sendPublish), topic, message);
-    // TODO: handle id values when the function is called later
-    if (id == 0)
-        return FAILURE;
-    else
-        return SUCCESS;
-#endif
-    PubMessage *message = mpool.alloc();
+    PubMessage *message = allocMessage();
     if (message == NULL){
       printf("====ERROR===== cannot allocate the object on mpool !!! \r\n");
       return -100;
     }
     // Simple copy
     *message = msg;
-    
-    // Push the data to the thread, wait and retry if queue is full
-    int counter=0;
-    while (mqueue.full() && (counter < 10)){
-        printf ("The message queue is full - let wait and retry %d \r\n", counter);
-        Thread::wait(1000);
-        counter++;
-    }
-    if (mqueue.full()) {
-         printf ("The message queue is full - give up on publishing\r\n ");
-         return -200;
-    }
 
-    //DBG("Pushing data to consumer thread ... %d\r\n", mqueue.full());
-    int ret = mqueue.put(message);
-    if (ret) printf("Return status from put: %d\r\n", ret);
-    return ret;
+    return publish(message);
 }
 
-int MQTTThreadedClient::sendPublish(PubMessage& message)
+int MQTTThreadedClient::tryPublish(PubMessage& msg)
 {
-     MQTTString topicString = MQTTString_initializer;
-     
-     if (!isConnected) 
-     {
-        DBG("Not connected!!! ...\r\n");
-        return FAILURE;
-     }
-        
-     topicString.cstring = (char*) &message.topic[0];
-     // printf("BEFORE MQTTSerialize_publish: strlen(sendbuf)=%d  MAX_MQTT_PACKET_SIZE=%d \r\n", strlen((const char*)sendbuf), MAX_MQTT_PACKET_SIZE);
-     // printf("BEFORE MQTTSerialize_publish: sendbuf = %s \r\n", sendbuf);
-     DBG("BEFORE MQTTSerialize_publish: msg.payload = %s \r\n", message.payload);
-     DBG("BEFORE MQTTSerialize_publish: strlen(msg.payload) = %d \r\n", strlen((const char*)message.payload));
+    PubMessage *message = allocMessage();
+    if (message == NULL)
+        return QUEUE_FULL;
 
-     int len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, message.qos, false, message.id,
-              topicString, (unsigned char*) &message.payload[0], (int) message.payloadlen);
-     if (len <= 0)
-     {
-         DBG("ERROR after MQTTSerialize_publish: Failed serializing message ...\r\n");
-         return FAILURE;
-     }
-     
-     if (sendPacket(len) == SUCCESS)
-     {
-         //DBG("Successfully published: topic=%s message=%s \r\n", (char*) &message.topic[0], (char*) &message.payload[0]);
-         return SUCCESS;
-     }
-    
-    DBG("Failed to send publish packet to server ...\r\n");
-    return FAILURE;
+    *message = msg;
+
+    return tryPublish(message);
 }
 
-void MQTTThreadedClient::addTopicHandler(const char * topicstr, void (*function)(MessageData &))
+PubMessage * MQTTThreadedClient::allocMessage()
 {
-    // Push the subscription into the map ...
-    F_P<void,MessageData &> fp;
-    fp.attach(function);
-    
-    topicCBMap.insert(std::pair<std::string, F_P<void,MessageData &> >(std::string(topicstr),fp));    
-} 
+    return mpool.alloc();
+}
 
-int MQTTThreadedClient::handlePublishMsg()
+void MQTTThreadedClient::freeMessage(PubMessage * message)
 {
-    MQTTString topicName = MQTTString_initializer;
-    Message msg;
-    int intQoS;
-    DBG("Deserializing publish message ...\r\n");
-    if (MQTTDeserialize_publish((unsigned char*)&msg.dup, 
-            &intQoS, 
-            (unsigned char*)&msg.retained, 
-            (unsigned short*)&msg.id, 
-            &topicName,
-            (unsigned char**)&msg.payload, 
-            (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
-    {
-        DBG("Error deserializing published message ...\r\n");
-        return -1;
-    }
-
-    std::string topic;
-    if (topicName.lenstring.len > 0)
-    {
-        topic = std::string((const char *) topicName.lenstring.data, (size_t) topicName.lenstring.len);
-    }else
-        topic = (const char *) topicName.cstring;
-    
-    DBG("Got message for topic [%s], QoS [%d] ...\r\n", topic.c_str(), intQoS);
-    
-    msg.qos = (QoS) intQoS;
+    if (message != NULL)
+        mpool.free(message);
+}
 
-    
-    // Call the handlers for each topic 
-    if (topicCBMap.find(topic) != topicCBMap.end())
-    {
-        // Call the callback function 
-        if (topicCBMap[topic].attached())
-        {
-            DBG("Invoking function handler for topic ...\r\n");
-            MessageData md(topicName, msg);            
-            topicCBMap[topic](md);
-            
-            return 1;
-        }
-    }
-    
-    // TODO: depending on the QoS
-    // we send data to the server = PUBACK or PUBREC
-    switch(intQoS)
-    {
-        case QOS0:
-            // We send back nothing ...
-            break;
-        case QOS1:
-            // TODO: implement
-            break;
-        case QOS2:
-            // TODO: implement
-            break;
-        default:
-            break;
-    }
-    
-    return 0;
+int MQTTThreadedClient::publish(PubMessage * message)
+{
+    return enqueueMessage(message, queueTimeout);
 }
 
-void MQTTThreadedClient::resetConnectionTimer()
+int MQTTThreadedClient::tryPublish(PubMessage * message)
 {
-    if (keepAliveInterval > 0)
-    {
-        comTimer.reset();
-        comTimer.start();
-    }
+    return enqueueMessage(message, 0);
 }
 
-bool MQTTThreadedClient::hasConnectionTimedOut()
+int MQTTThreadedClient::publishLatest(PubMessage& msg)
 {
-    if (keepAliveInterval > 0 ) {
-        // Check connection timer
-        if (  (unsigned int)(comTimer.read_ms()) > keepAliveInterval)
-            return true;
-        else
-            return false;
-    }
+    PubMessage *message = allocMessage();
+    if (message == NULL)
+        return QUEUE_FULL;
 
-    return false;
+    *message = msg;
+
+    return publishLatest(message);
+}
+
+int MQTTThreadedClient::publishLatest(PubMessage * message)
+{
+    return enqueueMessage(message, 0, true);
+}
+
+void MQTTThreadedClient::setQueuePolicy(QueueFullPolicy policy, uint32_t timeout_ms)
+{
+    outMutex.lock();
+    queuePolicy = policy;
+    queueTimeout = timeout_ms;
+    outMutex.unlock();
+}
+
+void MQTTThreadedClient::setSpool(MQTTSpool * aSpool)
+{
+    outMutex.lock();
+    spool = aSpool;
+    outMutex.unlock();
+}
+
+QueueStats MQTTThreadedClient::getQueueStats()
+{
+    QueueStats stats;
+
+    outMutex.lock();
+    stats = queueStats;
+    outMutex.unlock();
+
+    return stats;
+}
+
+/**
+ * Returns the queue index (0 is the oldest) of the pending message for
+ * topic, or -1 if there is none. Must be called with outMutex held.
+ **/
+int MQTTThreadedClient::findQueued(const char * topic)
+{
+    for (int i = 0; i < outCount; i++)
+    {
+        if (strcmp(outQueue[(outHead + i) % MBED_CONF_APP_MQTT_QUEUE_SIZE]->topic, topic) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Removes the message at index (0 is the oldest) from the outgoing
+ * queue and returns it. Must be called with outMutex held.
+ **/
+PubMessage * MQTTThreadedClient::removeQueued(int index)
+{
+    PubMessage *message = outQueue[(outHead + index) % MBED_CONF_APP_MQTT_QUEUE_SIZE];
+
+    // Close the gap by moving the newer entries one place towards the head
+    for (int i = index; i < outCount - 1; i++)
+    {
+        outQueue[(outHead + i) % MBED_CONF_APP_MQTT_QUEUE_SIZE] =
+            outQueue[(outHead + i + 1) % MBED_CONF_APP_MQTT_QUEUE_SIZE];
+        outLatest[(outHead + i) % MBED_CONF_APP_MQTT_QUEUE_SIZE] =
+            outLatest[(outHead + i + 1) % MBED_CONF_APP_MQTT_QUEUE_SIZE];
+    }
+    outCount--;
+
+    return message;
+}
+
+/**
+ * Puts a message on the outgoing queue. When the queue is full the
+ * configured QueueFullPolicy decides what happens; with
+ * QUEUE_FULL_BLOCK the caller waits up to timeout_ms for room.
+ * With latest set, a pending message for the same topic is replaced
+ * in its place in the queue, whether the queue is full or not.
+ * The client owns the message from here on, it is freed if dropped.
+ **/
+int MQTTThreadedClient::enqueueMessage(PubMessage * message, uint32_t timeout_ms, bool latest)
+{
+    Timer timer;
+
+    if (message == NULL)
+        return FAILURE;
+
+    // While offline, or still replaying, publishes go to the spool
+    // so that they are sent in order after the older ones. Only the
+    // newest latest-value message is worth sending, it stays queued.
+    outMutex.lock();
+    MQTTSpool *offline = (!latest && spool != NULL && (!isConnected || spool->count() > 0)) ? spool : NULL;
+    outMutex.unlock();
+    if (offline != NULL)
+    {
+        int rc = offline->append(*message);
+        mpool.free(message);
+        if (rc == SUCCESS)
+        {
+            outMutex.lock();
+            queueStats.queued++;
+            outMutex.unlock();
+        }
+        return rc;
+    }
+
+    timer.start();
+    while (true)
+    {
+        PubMessage *dropped = NULL;
+        bool queued = false;
+
+        outMutex.lock();
+        int pending = latest ? findQueued(message->topic) : -1;
+        if (pending >= 0)
+        {
+            int slot = (outHead + pending) % MBED_CONF_APP_MQTT_QUEUE_SIZE;
+            dropped = outQueue[slot];
+            outQueue[slot] = message;
+            outLatest[slot] = latest;
+            queueStats.coalesced++;
+            queued = true;
+        }
+        else if (outCount < MBED_CONF_APP_MQTT_QUEUE_SIZE)
+        {
+            outQueue[(outHead + outCount) % MBED_CONF_APP_MQTT_QUEUE_SIZE] = message;
+            outLatest[(outHead + outCount) % MBED_CONF_APP_MQTT_QUEUE_SIZE] = latest;
+            outCount++;
+            queued = true;
+        }
+        else if (queuePolicy == QUEUE_FULL_DROP_NEWEST)
+        {
+            dropped = message;
+            queueStats.droppedNewest++;
+        }
+        else if (queuePolicy != QUEUE_FULL_BLOCK)
+        {
+            int index = -1;
+
+            // Coalescing replaces a pending message for the same topic,
+            // otherwise (and for drop oldest) the oldest message goes
+            if (queuePolicy == QUEUE_FULL_COALESCE)
+                index = findQueued(message->topic);
+            if (index < 0)
+            {
+                index = 0;
+                queueStats.droppedOldest++;
+            }
+            else
+                queueStats.coalesced++;
+
+            dropped = removeQueued(index);
+            outQueue[(outHead + outCount) % MBED_CONF_APP_MQTT_QUEUE_SIZE] = message;
+            outLatest[(outHead + outCount) % MBED_CONF_APP_MQTT_QUEUE_SIZE] = latest;
+            outCount++;
+            queued = true;
+        }
+        if (queued)
+            queueStats.queued++;
+        outMutex.unlock();
+
+        if (dropped != NULL)
+        {
+            DBG("Dropped a queued message for [%s] ...\r\n", dropped->topic);
+            mpool.free(dropped);
+        }
+
+        if (queued)
+        {
+            // Wake up the listener to send it
+            listenerFlags.set(MQTT_FLAG_PUBLISH);
+            return SUCCESS;
+        }
+
+        if (dropped != NULL)
+            return QUEUE_FULL;
+
+        // Block until the listener makes room or we run out of time
+        int remaining = (int) timeout_ms - timer.read_ms();
+        if (remaining <= 0)
+        {
+            outMutex.lock();
+            queueStats.timedOut++;
+            outMutex.unlock();
+            mpool.free(message);
+            return TIMEOUT;
+        }
+        queueFlags.wait_any(MQTT_FLAG_QUEUE_SPACE, remaining);
+    }
+}
+
+/**
+ * Takes the oldest message off the outgoing queue, NULL if empty.
+ **/
+PubMessage * MQTTThreadedClient::dequeueMessage()
+{
+    PubMessage *message = NULL;
+
+    outMutex.lock();
+    if (outCount > 0)
+    {
+        message = outQueue[outHead];
+        outHead = (outHead + 1) % MBED_CONF_APP_MQTT_QUEUE_SIZE;
+        outCount--;
+    }
+    outMutex.unlock();
+
+    if (message != NULL)
+        queueFlags.set(MQTT_FLAG_QUEUE_SPACE);
+
+    return message;
+}
+
+int MQTTThreadedClient::sendPublish(PubMessage& message, bool dup)
+{
+     MQTTString topicString = MQTTString_initializer;
+     
+     if (!isConnected) 
+     {
+        DBG("Not connected!!! ...\r\n");
+        return FAILURE;
+     }
+        
+     topicString.cstring = (char*) &message.topic[0];
+     DBG("BEFORE MQTTSerialize_publishHeader: strlen(msg.payload) = %d \r\n", message.payloadlen);
+
+     // Only the fixed header, topic and packet id go through sendbuf, the
+     // payload is written straight from the pool message after it so that
+     // it is never copied and is not limited by the size of sendbuf.
+     int len = MQTTSerialize_publishHeader(sendbuf, sizeof(sendbuf), dup, message.qos, false, message.id,
+              topicString, (int) message.payloadlen);
+     if (len <= 0)
+     {
+         DBG("ERROR after MQTTSerialize_publishHeader: Failed serializing message ...\r\n");
+         return FAILURE;
+     }
+     
+     if (sendPacket(len) == SUCCESS &&
+         sendAll((const unsigned char*) &message.payload[0], message.payloadlen) == SUCCESS)
+     {
+         //DBG("Successfully published: topic=%s message=%s \r\n", (char*) &message.topic[0], (char*) &message.payload[0]);
+         return SUCCESS;
+     }
+    
+    DBG("Failed to send publish packet to server ...\r\n");
+    return FAILURE;
+}
+
+/**
+ * Sends one of the two byte acknowledgement packets
+ * (PUBACK, PUBREC, PUBREL or PUBCOMP) for the given packet id.
+ **/
+int MQTTThreadedClient::sendAck(unsigned char type, unsigned short id)
+{
+    int len = MQTTSerialize_ack(sendbuf, sizeof(sendbuf), type, 0, id);
+    if (len <= 0)
+    {
+        DBG("Error serializing ack type [%d] ...\r\n", type);
+        return FAILURE;
+    }
+
+    return sendPacket(len);
+}
+
+int MQTTThreadedClient::findInFlight(unsigned short id)
+{
+    for (int i = 0; i < MBED_CONF_APP_MQTT_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].state != INFLIGHT_FREE && inflight[i].message->id == id)
+            return i;
+    }
+    return -1;
+}
+
+int MQTTThreadedClient::findFreeInFlight()
+{
+    for (int i = 0; i < MBED_CONF_APP_MQTT_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].state == INFLIGHT_FREE)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Records the packet id of an inbound QoS2 publish until its PUBREL.
+ * Returns false if it is already there, the publish is then a
+ * duplicate of one already delivered.
+ **/
+bool MQTTThreadedClient::markReceivedQos2(unsigned short id)
+{
+    int free = -1;
+
+    for (int i = 0; i < MBED_CONF_APP_MQTT_MAX_INFLIGHT; i++)
+    {
+        if (receivedQos2[i] == id)
+            return false;
+        if (receivedQos2[i] == 0 && free < 0)
+            free = i;
+    }
+
+    // When full the oldest entry goes, its PUBREL is long overdue
+    if (free < 0)
+    {
+        free = receivedQos2Next;
+        receivedQos2Next = (receivedQos2Next + 1) % MBED_CONF_APP_MQTT_MAX_INFLIGHT;
+    }
+    receivedQos2[free] = id;
+
+    return true;
+}
+
+void MQTTThreadedClient::releaseReceivedQos2(unsigned short id)
+{
+    for (int i = 0; i < MBED_CONF_APP_MQTT_MAX_INFLIGHT; i++)
+    {
+        if (receivedQos2[i] == id)
+            receivedQos2[i] = 0;
+    }
+}
+
+/**
+ * Advances the state machine of an outgoing QoS1/QoS2 publish
+ * on receipt of PUBACK, PUBREC or PUBCOMP from the server.
+ **/
+int MQTTThreadedClient::handleAckMsg(int packetType)
+{
+    unsigned char type = 0;
+    unsigned char dup = 0;
+    unsigned short id = 0;
+
+    if (MQTTDeserialize_ack(&type, &dup, &id, readbuf, sizeof(readbuf)) != 1)
+    {
+        DBG("Error deserializing ack type [%d] ...\r\n", packetType);
+        return FAILURE;
+    }
+
+    int slot = findInFlight(id);
+    if (slot < 0)
+    {
+        // Late duplicate of something we have already completed. A PUBREC
+        // still needs its PUBREL so the server can release the packet id.
+        DBG("No in-flight message with id [%d] ...\r\n", id);
+        return (packetType == PUBREC) ? sendAck(PUBREL, id) : SUCCESS;
+    }
+
+    InFlightMessage &m = inflight[slot];
+    switch (packetType)
+    {
+        case PUBACK:
+        case PUBCOMP:
+            if ((packetType == PUBACK && m.state != INFLIGHT_WAIT_PUBACK) ||
+                (packetType == PUBCOMP && m.state != INFLIGHT_WAIT_PUBCOMP))
+            {
+                DBG("Unexpected ack type [%d] for id [%d] ...\r\n", packetType, id);
+                return SUCCESS;
+            }
+            DBG("Message id [%d] delivered ...\r\n", id);
+            mpool.free(m.message);
+            m.message = NULL;
+            m.state = INFLIGHT_FREE;
+            break;
+        case PUBREC:
+            // A repeated PUBREC gets its PUBREL again, one for a QoS1
+            // message is a broker error
+            if (m.state != INFLIGHT_WAIT_PUBREC && m.state != INFLIGHT_WAIT_PUBCOMP)
+            {
+                DBG("Unexpected ack type [%d] for id [%d] ...\r\n", packetType, id);
+                return SUCCESS;
+            }
+            m.state = INFLIGHT_WAIT_PUBCOMP;
+            m.sent_ms = retryTimer.read_ms();
+            return sendAck(PUBREL, id);
+        default:
+            break;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Resends the in-flight messages whose acknowledgement is overdue, or
+ * all of them (after a reconnect) when all is true. Publishes are resent
+ * with the DUP flag set, PUBRELs are resent as is.
+ **/
+int MQTTThreadedClient::retransmitInFlight(bool all)
+{
+    int now = retryTimer.read_ms();
+
+    for (int i = 0; i < MBED_CONF_APP_MQTT_MAX_INFLIGHT; i++)
+    {
+        InFlightMessage &m = inflight[i];
+        int rc;
+
+        if (m.state == INFLIGHT_FREE)
+            continue;
+        if (!all && (now - m.sent_ms) < MBED_CONF_APP_MQTT_RETRY_TIMEOUT_MS)
+            continue;
+
+        DBG("Retransmitting message id [%d] ...\r\n", m.message->id);
+        if (m.state == INFLIGHT_WAIT_PUBCOMP)
+            rc = sendAck(PUBREL, m.message->id);
+        else
+            rc = sendPublish(*m.message, true);
+
+        if (rc != SUCCESS)
+            return rc;
+        m.sent_ms = now;
+    }
+
+    return SUCCESS;
+}
+
+int MQTTThreadedClient::addTopicHandler(const char * topicstr, void (*function)(MessageData &), QoS qos)
+{
+    F_P<void,MessageData &> fp;
+    fp.attach(function);
+
+    if (strlen(topicstr) >= sizeof(subscriptions[0].filter))
+        return BUFFER_OVERFLOW;
+
+    subMutex.lock();
+
+    // A filter is only subscribed to once, with the highest QoS asked for
+    int sub;
+    for (sub = 0; sub < subscriptionCount; sub++)
+    {
+        if (strcmp(subscriptions[sub].filter, topicstr) == 0)
+            break;
+    }
+    if (sub == subscriptionCount && subscriptionCount >= MBED_CONF_APP_MQTT_MAX_HANDLERS)
+    {
+        subMutex.unlock();
+        return BUFFER_OVERFLOW;
+    }
+
+    int rc = topicHandlers.add(topicstr, fp);
+    if (rc == SUCCESS)
+    {
+        if (sub == subscriptionCount)
+        {
+            strcpy(subscriptions[sub].filter, topicstr);
+            subscriptions[sub].qos = qos;
+            subscriptions[sub].id = 0;
+            subscriptions[sub].state = SUB_PENDING;
+            subscriptionCount++;
+        }
+        else if (qos > subscriptions[sub].qos)
+        {
+            subscriptions[sub].qos = qos;
+            subscriptions[sub].state = SUB_PENDING;
+        }
+    }
+
+    subMutex.unlock();
+
+    // Wake up the listener to send the SUBSCRIBE
+    if (rc == SUCCESS)
+        listenerFlags.set(MQTT_FLAG_PUBLISH);
+
+    return rc;
+}
+
+/**
+ * Sends a SUBSCRIBE for every subscription that has not been sent on
+ * this connection yet.
+ **/
+int MQTTThreadedClient::sendSubscriptions()
+{
+    int rc = SUCCESS;
+
+    subMutex.lock();
+    for (int sub = 0; sub < subscriptionCount && rc == SUCCESS; sub++)
+    {
+        if (subscriptions[sub].state != SUB_PENDING)
+            continue;
+
+        MQTTString topic = MQTTString_initializer;
+        int qos = subscriptions[sub].qos;
+        topic.cstring = subscriptions[sub].filter;
+        subscriptions[sub].id = packetid.getNext();
+
+        int len = MQTTSerialize_subscribe(sendbuf, sizeof(sendbuf), 0, subscriptions[sub].id, 1, &topic, &qos);
+        if (len <= 0)
+        {
+            DBG("Error serializing subscribe for [%s] ...\r\n", subscriptions[sub].filter);
+            subscriptions[sub].state = SUB_REJECTED;
+            continue;
+        }
+
+        DBG("Subscribing to [%s] ...\r\n", subscriptions[sub].filter);
+        rc = sendPacket((size_t) len);
+        if (rc == SUCCESS)
+            subscriptions[sub].state = SUB_SENT;
+    }
+    subMutex.unlock();
+
+    return rc;
+}
+
+/**
+ * Marks the subscriptions to be sent again after a reconnect: all of
+ * them when the broker has not kept our session, otherwise only those
+ * whose SUBACK never arrived.
+ **/
+void MQTTThreadedClient::resetSubscriptions(bool all)
+{
+    subMutex.lock();
+    for (int sub = 0; sub < subscriptionCount; sub++)
+    {
+        if (all || subscriptions[sub].state != SUB_ACKED)
+            subscriptions[sub].state = SUB_PENDING;
+    }
+    subMutex.unlock();
+}
+
+int MQTTThreadedClient::handleSubAck()
+{
+    unsigned short id = 0;
+    int count = 0;
+    int grantedQoS = 0;
+
+    if (MQTTDeserialize_suback(&id, 1, &count, &grantedQoS, readbuf, sizeof(readbuf)) != 1)
+    {
+        DBG("Error deserializing SUBACK ...\r\n");
+        return SUCCESS;
+    }
+
+    subMutex.lock();
+    for (int sub = 0; sub < subscriptionCount; sub++)
+    {
+        if (subscriptions[sub].state != SUB_SENT || subscriptions[sub].id != id)
+            continue;
+
+        // 0x80 is the broker's failure return code
+        if (grantedQoS == 0x80)
+        {
+            mbedtls_printf("Subscription to [%s] refused\r\n", subscriptions[sub].filter);
+            subscriptions[sub].state = SUB_REJECTED;
+        }
+        else
+        {
+            DBG("Subscribed to [%s] with QoS %d\r\n", subscriptions[sub].filter, grantedQoS);
+            subscriptions[sub].state = SUB_ACKED;
+        }
+        break;
+    }
+    subMutex.unlock();
+
+    return SUCCESS;
+} 
+
+int MQTTThreadedClient::handlePublishMsg()
+{
+    MQTTString topicName = MQTTString_initializer;
+    Message msg;
+    int intQoS;
+    DBG("Deserializing publish message ...\r\n");
+    if (MQTTDeserialize_publish((unsigned char*)&msg.dup, 
+            &intQoS, 
+            (unsigned char*)&msg.retained, 
+            (unsigned short*)&msg.id, 
+            &topicName,
+            (unsigned char**)&msg.payload, 
+            (int*)&msg.payloadlen, readbuf, sizeof(readbuf)) != 1)
+    {
+        DBG("Error deserializing published message ...\r\n");
+        // Skip what is left of it to keep the stream in sync
+        return (discardBytes(readPending) == SUCCESS) ? 0 : FAILURE;
+    }
+
+    // The topic is matched in place in readbuf, without copying it
+    const char * topic = topicName.lenstring.data;
+    size_t topicLen = topicName.lenstring.len;
+    if (topic == NULL)
+    {
+        topic = topicName.cstring;
+        topicLen = strlen(topic);
+    }
+    
+    DBG("Got message for topic [%.*s], QoS [%d] ...\r\n", (int) topicLen, topic, intQoS);
+    
+    msg.qos = (QoS) intQoS;
+
+    // The whole payload is in readbuf unless readPacket() left some of
+    // it on the network, in which case the handler gets the part that is
+    // in readbuf first and then the rest, one buffer full at a time.
+    unsigned char *payloadStart = (unsigned char *) msg.payload;
+    size_t chunkMax = (readbuf + sizeof(readbuf)) - payloadStart;
+    msg.payloadtotal = msg.payloadlen;
+    msg.payloadoffset = 0;
+    if (readPending > 0)
+        msg.payloadlen = chunkMax;
+
+    int rc = 0;
+
+    // A QoS2 publish is delivered once, a DUP resent before its PUBREL
+    // is only acknowledged again
+    if (msg.qos == QOS2 && !markReceivedQos2(msg.id))
+    {
+        DBG("Duplicate QoS2 message id [%d] ...\r\n", msg.id);
+        if (discardBytes(readPending) != SUCCESS)
+            return FAILURE;
+        readPending = 0;
+        return (sendAck(PUBREC, msg.id) == SUCCESS) ? 0 : FAILURE;
+    }
+
+    while (true)
+    {
+        // Call the handlers of every matching filter
+        MessageData md(topicName, msg);
+        subMutex.lock();
+        if (topicHandlers.dispatch(topic, topicLen, md) > 0)
+            rc = 1;
+        subMutex.unlock();
+
+        if (readPending == 0)
+            break;
+
+        // Read the next chunk of the payload over the previous one
+        msg.payloadoffset += msg.payloadlen;
+        msg.payloadlen = (readPending < chunkMax) ? readPending : chunkMax;
+        if (readAll(payloadStart, msg.payloadlen) != SUCCESS)
+            return FAILURE;
+        readPending -= msg.payloadlen;
+    }
+    
+    // Depending on the QoS we acknowledge the message to the server
+    // with PUBACK or PUBREC. For QoS2 the message is delivered on
+    // arrival of the PUBLISH, its id is kept until the later PUBREL
+    // is answered with PUBCOMP in the listener.
+    switch(intQoS)
+    {
+        case QOS0:
+            // We send back nothing ...
+            break;
+        case QOS1:
+            if (sendAck(PUBACK, msg.id) != SUCCESS)
+                return FAILURE;
+            break;
+        case QOS2:
+            if (sendAck(PUBREC, msg.id) != SUCCESS)
+                return FAILURE;
+            break;
+        default:
+            break;
+    }
+    
+    return rc;
+}
+
+void MQTTThreadedClient::resetConnectionTimer()
+{
+    if (keepAliveInterval > 0)
+    {
+        comTimer.reset();
+        comTimer.start();
+    }
+}
+
+bool MQTTThreadedClient::hasConnectionTimedOut()
+{
+    if (keepAliveInterval > 0 ) {
+        // Check connection timer
+        if (  (unsigned int)(comTimer.read_ms()) >= keepAliveInterval)
+            return true;
+        else
+            return false;
+    }
+
+    return false;
 }
         
-void MQTTThreadedClient::sendPingRequest()
+int MQTTThreadedClient::sendPingRequest()
 {
-    int len = MQTTSerialize_pingreq(sendbuf, MAX_MQTT_PACKET_SIZE);
+    int len = MQTTSerialize_pingreq(sendbuf, sizeof(sendbuf));
     if (len > 0 && (sendPacket(len) == SUCCESS)) // send the ping packet
     {
         DBG("Ping request sent successfully ...\r\n");
+        return SUCCESS;
     }
+    return FAILURE;
 }
 
-void MQTTThreadedClient::startListener()
+/**
+ * Sends a ping when the keep alive interval has passed without any
+ * other traffic, and fails if the server does not answer in time.
+ **/
+int MQTTThreadedClient::serviceKeepAlive()
 {
+    if (pingOutstanding)
+    {
+        if (retryTimer.read_ms() - pingSentMs >= COMMAND_TIMEOUT)
+        {
+            DBG("No ping response from server ...\r\n");
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
 
+    // Check if its time to send a keepAlive packet
+    if (hasConnectionTimedOut())
+    {
+        if (sendPingRequest() != SUCCESS)
+            return FAILURE;
+        pingOutstanding = true;
+        pingSentMs = retryTimer.read_ms();
+    }
 
+    return SUCCESS;
+}
 
+/**
+ * Returns the time in ms until the listener next has something to
+ * do on its own (keep alive or retransmit), or osWaitForever.
+ **/
+uint32_t MQTTThreadedClient::nextWakeup()
+{
+    int now = retryTimer.read_ms();
+    bool haveDeadline = true;
+    int wakeup = 0;
+    int remaining;
+
+    if (pingOutstanding)
+        wakeup = COMMAND_TIMEOUT - (now - pingSentMs);
+    else if (keepAliveInterval > 0)
+        wakeup = (int) keepAliveInterval - comTimer.read_ms();
+    else
+        haveDeadline = false;
+
+    for (int i = 0; i < MBED_CONF_APP_MQTT_MAX_INFLIGHT; i++)
+    {
+        if (inflight[i].state == INFLIGHT_FREE)
+            continue;
+        remaining = MBED_CONF_APP_MQTT_RETRY_TIMEOUT_MS - (now - inflight[i].sent_ms);
+        if (!haveDeadline || remaining < wakeup)
+            wakeup = remaining;
+        haveDeadline = true;
+    }
+
+    if (!haveDeadline)
+        return osWaitForever;
+
+    return (wakeup > 0) ? wakeup : 0;
+}
+
+/**
+ * Called by the network stack whenever the socket state changes,
+ * possibly from interrupt context. Just wakes up the listener.
+ **/
+void MQTTThreadedClient::onSocketEvent()
+{
+    listenerFlags.set(MQTT_FLAG_SOCKET);
+}
+
+/**
+ * Handles one packet read by readPacket(). Returns SUCCESS or
+ * FAILURE if the connection is no longer usable.
+ **/
+int MQTTThreadedClient::handlePacket(int pType)
+{
+    switch(pType) 
+    {
+        case FAILURE:
+            {
+                DBG("readPacket returned failure \r\n");
+                return FAILURE;
+            }
+        case BUFFER_OVERFLOW: 
+            {
+                // The packet did not fit and has been skipped,
+                // the connection itself is still usable
+                DBG("Dropped packet too large for the read buffer ... \r\n");
+            }
+            break;
+        /**
+        *  The rest of the return codes below (all positive) is about MQTT
+         * response codes
+         **/
+        case CONNACK:
+            break;
+        case SUBACK:
+            return handleSubAck();
+        case PUBACK:
+        case PUBREC:
+        case PUBCOMP:
+            return handleAckMsg(pType);
+        case PUBREL:
+            {
+                // Final step of an inbound QoS2 message
+                unsigned char type = 0, dup = 0;
+                unsigned short id = 0;
+                if (MQTTDeserialize_ack(&type, &dup, &id, readbuf, sizeof(readbuf)) == 1)
+                {
+                    releaseReceivedQos2(id);
+                    return sendAck(PUBCOMP, id);
+                }
+            }
+            break;
+        case PUBLISH: 
+            {
+                DBG("Publish received!....\r\n");
+                // We receive data from the MQTT server ..
+                if (handlePublishMsg() < 0) {
+                    DBG("Error handling PUBLISH message ... \r\n");
+                    return FAILURE;
+                }
+            }
+            break;
+        case PINGRESP: 
+            {
+                DBG("Got ping response ...\r\n");
+                pingOutstanding = false;
+                resetConnectionTimer();
+            }
+            break;
+        default:
+            DBG("Unknown/Not handled message from server pType[%d]\r\n", pType);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Moves the messages still waiting in the queue to the spool, so that
+ * they survive the outage instead of being sent stale or lost.
+ * Latest-value messages stay queued, a newer one replaces them.
+ **/
+int MQTTThreadedClient::spoolQueuedMessages()
+{
+    if (spool == NULL)
+        return SUCCESS;
+
+    while (true)
+    {
+        PubMessage * message = NULL;
+
+        outMutex.lock();
+        for (int i = 0; i < outCount && message == NULL; i++)
+        {
+            if (!outLatest[(outHead + i) % MBED_CONF_APP_MQTT_QUEUE_SIZE])
+                message = removeQueued(i);
+        }
+        outMutex.unlock();
+
+        if (message == NULL)
+            break;
+
+        queueFlags.set(MQTT_FLAG_QUEUE_SPACE);
+        spool->append(*message);
+        mpool.free(message);
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Sends a message taken from the queue or spool, tracking it in the
+ * given in-flight slot if it needs acknowledging.
+ **/
+int MQTTThreadedClient::sendMessage(PubMessage * message, int slot)
+{
+    DBG("Got message to publish! ... \r\n");
+
+    // QoS1/QoS2 messages are tracked until acknowledged,
+    // they need a unique, non zero packet id
+    if (message->qos != QOS0) {
+        message->id = packetid.getNext();
+        inflight[slot].message = message;
+        inflight[slot].state = (message->qos == QOS1) ? INFLIGHT_WAIT_PUBACK : INFLIGHT_WAIT_PUBREC;
+        inflight[slot].sent_ms = retryTimer.read_ms();
+    }
+
+    int rc = sendPublish(*message);
+    if (rc == SUCCESS) {
+        // Reset timers if we have been able to send successfully
+        resetConnectionTimer();
+    }
+
+    // QoS0 messages are done with once sent, the others
+    // are freed when their final ack arrives
+    if (message->qos == QOS0)
+        mpool.free(message);
+
+    return rc;
+}
+
+/**
+ * Sends messages from the message queue while there is room
+ * in the in-flight window, otherwise they wait for an ack.
+ **/
+int MQTTThreadedClient::sendQueuedMessages()
+{
+    int slot;
+    int replayed = 0;
+
+    // While the spool holds messages the queue only holds latest-value
+    // ones, which are sent first rather than behind a stale backlog
+    while ((slot = findFreeInFlight()) >= 0)
+    {
+        PubMessage * message = dequeueMessage();
+        if (message == NULL)
+            break;
+
+        if (sendMessage(message, slot) != SUCCESS) {
+            // Disconnected?
+            return FAILURE;
+        }
+    }
+
+    // Then replay the spool, a batch at a time so incoming packets
+    // are still handled
+    while (spool != NULL && spool->count() > 0 && (slot = findFreeInFlight()) >= 0)
+    {
+        if (replayed >= MBED_CONF_APP_MQTT_MAX_INFLIGHT) {
+            listenerFlags.set(MQTT_FLAG_PUBLISH);
+            return SUCCESS;
+        }
+
+        PubMessage * message = allocMessage();
+        if (message == NULL)
+            return SUCCESS;
+
+        if (spool->peek(*message) != SUCCESS) {
+            // Unreadable record, skip it
+            mpool.free(message);
+            spool->pop();
+            continue;
+        }
+
+        // Forget the record once it has gone out, or as soon as it is
+        // in flight since the in-flight table resends it from then on
+        QoS qos = message->qos;
+        int rc = sendMessage(message, slot);
+        if (rc == SUCCESS || qos != QOS0)
+            spool->pop();
+        if (rc != SUCCESS)
+            return FAILURE;
+        replayed++;
+    }
+
+    return SUCCESS;
+}
+
+/**
+ * Returns how long to wait before the next connect attempt, doubling
+ * the back off each time. Half of it is random so that a fleet of
+ * devices that lost the same access point does not reconnect in step.
+ **/
+uint32_t MQTTThreadedClient::nextReconnectDelay()
+{
+    if (reconnectDelay == 0)
+        reconnectDelay = MBED_CONF_APP_MQTT_RECONNECT_MIN_MS;
+    else if (reconnectDelay < MBED_CONF_APP_MQTT_RECONNECT_MAX_MS / 2)
+        reconnectDelay *= 2;
+    else
+        reconnectDelay = MBED_CONF_APP_MQTT_RECONNECT_MAX_MS;
+
+    // rand() is seeded the same on every device, prefer the DRBG
+    uint32_t random = rand();
+    if (useTLS)
+        mbedtls_ctr_drbg_random(&_ctr_drbg, (unsigned char *) &random, sizeof(random));
+
+    return reconnectDelay / 2 + random % (reconnectDelay / 2 + 1);
+}
+
+void MQTTThreadedClient::startListener()
+{
     mbedtls_printf(" startListener() \r\n ");
 
     int pType;
@@ -857,115 +2001,81 @@ void MQTTThreadedClient::startListener()
     {
         initTLS();
     }
-     
+
+    retryTimer.start();
      
     while(true)
     {
 
         mbedtls_printf("startListener(): Attempting connect \r\n ");
 
-        // Attempt to reconnect and login
-        if ( connect() < 0 )
+        // Attempt to reconnect and login. A CONNACK refusing the
+        // connection returns its positive return code, back off for
+        // that as for any other failure.
+        int rc = connect();
+        if ( rc != SUCCESS )
         {
             disconnect();
-            // Wait for a few secs and reconnect ...
-            Thread::wait(6000); //6000 millisec = 6 sec
-            tcpSocket = new TCPSocket(network);
+            uint32_t delay = nextReconnectDelay();
+            mbedtls_printf("startListener(): Connect failed (%d), retrying in %lu ms\r\n", rc, (unsigned long) delay);
+            Thread::wait(delay);
             continue;
         }
 
-        mbedtls_printf("startListener(): Done connect\r\n");
+        mbedtls_printf("startListener(): Done connect%s\r\n", sessionPresent ? ", session resumed" : "");
+        // The broker accepted us, the next time the connection drops
+        // retry straight away
+        reconnectDelay = 0;
+        pingOutstanding = false;
+
+        // Without our session the broker has forgotten the subscriptions
+        // and the QoS2 publishes it has not released yet
+        resetSubscriptions(!sessionPresent);
+        if (!sessionPresent)
+            memset(receivedQos2, 0, sizeof(receivedQos2));
+        if (sendSubscriptions() != SUCCESS)
+            goto reconnect;
+
+        // Anything left in flight from the previous connection
+        // is resent straight away
+        if (retransmitInFlight(true) != SUCCESS)
+            goto reconnect;
          
-        // loop read    
+        // The only place the listener blocks is the wait at the bottom,
+        // it is woken up by the socket, by publish() or when a keep alive
+        // or retransmission is due.
         while(true) 
         {
-            pType = readPacket();
-            switch(pType) 
+            // Handle everything that has arrived. With TLS, decrypted
+            // data may be buffered without a new socket event, so read
+            // until there is nothing left.
+            while ((pType = readPacket()) != TIMEOUT)
             {
-                case TIMEOUT:
-                    // No data available from the network ...
-                    break;
-                case FAILURE:
-                    {
-                        DBG("readPacket returned failure \r\n");
-                        goto reconnect;
-                    }
-                case BUFFER_OVERFLOW: 
-                    {
-                        // TODO: Network error, do we disconnect and reconnect?
-                        DBG("Failure or buffer overflow problem ... \r\n");
-                        MBED_ASSERT(false);
-                    }
-                    break;
-                /**
-                *  The rest of the return codes below (all positive) is about MQTT
-                 * response codes
-                 **/
-                case CONNACK:
-                case PUBACK:
-                case SUBACK:
-                    break;
-                case PUBLISH: 
-                    {
-                        DBG("Publish received!....\r\n");
-                        // We receive data from the MQTT server ..
-                        if (handlePublishMsg() < 0) {
-                            DBG("Error handling PUBLISH message ... \r\n");
-                            break;
-                        }
-                    }
-                    break;
-                case PINGRESP: 
-                    {
-                        DBG("Got ping response ...\r\n");
-                        resetConnectionTimer();
-                    }
-                    break;
-                default:
-                    DBG("Unknown/Not handled message from server pType[%d]\r\n", pType);
+                if (handlePacket(pType) != SUCCESS)
+                    goto reconnect;
             }
 
-            // Check if its time to send a keepAlive packet
-            if (hasConnectionTimedOut()) {
-                // Queue the ping request so that other
-                // pending operations queued above will go first
-                queue.call(this, &MQTTThreadedClient::sendPingRequest);
-            }
-
-             // Check if we have messages on the message queue
-             osEvent evt = mqueue.get(10);   //the argument is timeout in millisec
-             if (evt.status == osEventMessage) {
-
-                 DBG("Got message to publish! ... \r\n");
-
-                 // Unpack the message
-                 PubMessage * message = (PubMessage *)evt.value.p;
-
-                 // Send the packet, do not queue the call
-                 // like the ping above ..
-                 if ( sendPublish(*message) == SUCCESS) {
-                     // Reset timers if we have been able to send successfully
-                     resetConnectionTimer();
-                 } else {
-                     // Disconnected?
-                     goto reconnect;
-                 }
-
-                 // Free the message from mempool  after using
-                 mpool.free(message);
-             }
+            if (serviceKeepAlive() != SUCCESS)
+                goto reconnect;
 
-            // // Dispatch any queued events ...
-             queue.dispatch(100); //TODO - what it is??
+            // Resend anything whose acknowledgement is overdue
+            if (retransmitInFlight(false) != SUCCESS)
+                goto reconnect;
 
+            if (sendSubscriptions() != SUCCESS)
+                goto reconnect;
 
+            if (sendQueuedMessages() != SUCCESS)
+                goto reconnect;
 
+            listenerFlags.wait_any(MQTT_FLAG_SOCKET | MQTT_FLAG_PUBLISH, nextWakeup());
         } // end while loop
 
 reconnect:
         // reconnect?
         DBG("startListener() Client disconnected!! ... retrying ...\r\n");
         disconnect();
+        spoolQueuedMessages();
         
     }; //end of while(true)
 }
@@ -7,6 +7,11 @@
 #include "NetworkInterface.h"
 #include "FP.h"
 #include "mbedtls/debug.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "TLSCredentials.h"
+#include "MQTTTopicTrie.h"
 
 // #define MQTT_DEBUG 1
 
@@ -22,10 +27,72 @@
 #include <string>
 #include <map>
 
+// Listener wake up reasons
+#define MQTT_FLAG_SOCKET  (1 << 0)
+#define MQTT_FLAG_PUBLISH (1 << 1)
+
+// Publisher wake up reason
+#define MQTT_FLAG_QUEUE_SPACE (1 << 0)
+
 #define COMMAND_TIMEOUT 5000
 #define DEFAULT_SOCKET_TIMEOUT 1000
-#define MAX_MQTT_PACKET_SIZE 500
-#define MAX_MQTT_PAYLOAD_SIZE 1000
+
+// Size of the buffer outgoing packets are serialized into. Publish payloads
+// are written straight from the message, so this only has to hold a
+// CONNECT packet or the header and topic of a publish.
+#ifndef MBED_CONF_APP_MQTT_SEND_BUFFER_SIZE
+#define MBED_CONF_APP_MQTT_SEND_BUFFER_SIZE 256
+#endif
+
+// Size of the buffer incoming packets are read into. A PUBLISH whose payload
+// does not fit is handed to the topic handler in several chunks.
+#ifndef MBED_CONF_APP_MQTT_READ_BUFFER_SIZE
+#define MBED_CONF_APP_MQTT_READ_BUFFER_SIZE 500
+#endif
+
+// Largest payload that can be published with a PubMessage
+#ifndef MBED_CONF_APP_MQTT_MAX_PAYLOAD_SIZE
+#define MBED_CONF_APP_MQTT_MAX_PAYLOAD_SIZE 1000
+#endif
+
+#define MAX_MQTT_PAYLOAD_SIZE MBED_CONF_APP_MQTT_MAX_PAYLOAD_SIZE
+
+// Number of QoS1/QoS2 publishes that may be outstanding (sent but not
+// yet fully acknowledged) at the same time.
+#ifndef MBED_CONF_APP_MQTT_MAX_INFLIGHT
+#define MBED_CONF_APP_MQTT_MAX_INFLIGHT 4
+#endif
+
+// Time in ms to wait for an acknowledgement before retransmitting
+#ifndef MBED_CONF_APP_MQTT_RETRY_TIMEOUT_MS
+#define MBED_CONF_APP_MQTT_RETRY_TIMEOUT_MS 5000
+#endif
+
+// Number of messages waiting to be sent that the outgoing queue holds
+#ifndef MBED_CONF_APP_MQTT_QUEUE_SIZE
+#define MBED_CONF_APP_MQTT_QUEUE_SIZE 4
+#endif
+
+// Time in ms publish() blocks for room in a full queue (QUEUE_FULL_BLOCK)
+#ifndef MBED_CONF_APP_MQTT_QUEUE_TIMEOUT_MS
+#define MBED_CONF_APP_MQTT_QUEUE_TIMEOUT_MS 10000
+#endif
+
+// Reconnect back off: a dropped connection is retried at once, after
+// that the wait doubles from the minimum up to the maximum, with jitter
+#ifndef MBED_CONF_APP_MQTT_RECONNECT_MIN_MS
+#define MBED_CONF_APP_MQTT_RECONNECT_MIN_MS 500
+#endif
+
+#ifndef MBED_CONF_APP_MQTT_RECONNECT_MAX_MS
+#define MBED_CONF_APP_MQTT_RECONNECT_MAX_MS 60000
+#endif
+
+// Persist the TLS session (encrypted) in the keystore so that it can
+// be resumed after a reboot
+#ifndef MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+#define MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST 0
+#endif
 
 namespace MQTT
 {
@@ -33,7 +100,7 @@ namespace MQTT
 typedef enum { QOS0, QOS1, QOS2 } QoS;
 
 // all failure return codes must be negative
-typedef enum { BUFFER_OVERFLOW = -3, TIMEOUT = -2, FAILURE = -1, SUCCESS = 0 } returnCode;
+typedef enum { QUEUE_FULL = -4, BUFFER_OVERFLOW = -3, TIMEOUT = -2, FAILURE = -1, SUCCESS = 0 } returnCode;
 
 
 typedef struct
@@ -44,6 +111,10 @@ typedef struct
     unsigned short id;
     void *payload;
     size_t payloadlen;
+    // Large payloads arrive in several chunks, each delivered with
+    // its offset within the whole payload of payloadtotal bytes.
+    size_t payloadoffset;
+    size_t payloadtotal;
 }Message, *pMessage;
 
 // TODO:
@@ -93,33 +164,120 @@ private:
 
 
 
+// State of an outgoing QoS1/QoS2 publish in the in-flight window
+typedef enum
+{
+    INFLIGHT_FREE = 0,
+    INFLIGHT_WAIT_PUBACK,   // QoS1, waiting for PUBACK
+    INFLIGHT_WAIT_PUBREC,   // QoS2, waiting for PUBREC
+    INFLIGHT_WAIT_PUBCOMP   // QoS2, PUBREL sent, waiting for PUBCOMP
+} InFlightState;
+
+typedef struct
+{
+    InFlightState state;
+    PubMessage *message;    // owned by the message pool until acknowledged
+    int sent_ms;            // time of the last (re)transmission
+} InFlightMessage;
+
+// What publishing does when the outgoing queue is full
+typedef enum
+{
+    QUEUE_FULL_BLOCK = 0,   // wait for room, up to the queue timeout
+    QUEUE_FULL_DROP_OLDEST, // drop the oldest queued message
+    QUEUE_FULL_DROP_NEWEST, // drop the message being published
+    QUEUE_FULL_COALESCE     // replace a queued message for the same topic,
+                            // else drop the oldest
+} QueueFullPolicy;
+
+// Counters of what happened to messages handed to publish()
+typedef struct
+{
+    unsigned int queued;
+    unsigned int droppedOldest;
+    unsigned int droppedNewest;
+    unsigned int coalesced;
+    unsigned int timedOut;
+} QueueStats;
+
+// Counters of TLS handshakes, resumed ones skip the certificate
+// exchange and key agreement of a full handshake
+typedef struct
+{
+    unsigned int fullHandshakes;
+    unsigned int resumedHandshakes;
+    unsigned int failedHandshakes;
+} TLSStats;
+
+// State of a subscription with the broker
+typedef enum
+{
+    SUB_PENDING = 0,    // to be sent
+    SUB_SENT,           // SUBSCRIBE sent, waiting for SUBACK
+    SUB_ACKED,          // granted by the broker
+    SUB_REJECTED        // refused by the broker, retried on reconnect
+} SubscriptionState;
+
+typedef struct
+{
+    char filter[100];
+    QoS qos;
+    unsigned short id;
+    SubscriptionState state;
+} Subscription;
+
+class MQTTSpool;
+
 class MQTTThreadedClient
 {
 public:
-    MQTTThreadedClient(NetworkInterface * aNetwork, const unsigned char * ca = NULL, const unsigned char * clientCert = NULL, const unsigned char * clientPkey = NULL, bool isDER = false)
+    /**
+     *  @param aNetwork - the network interface to connect through
+     *  @param aCredentials - the TLS credentials, allocated with new and
+     *         possibly shared with other clients; NULL for a plain TCP
+     *         connection
+     */
+    MQTTThreadedClient(NetworkInterface * aNetwork, TLSCredentials * aCredentials = NULL)
         : network(aNetwork),
-          ssl_ca(ca),
-          ssl_client_cert(clientCert),
-          ssl_client_pkey(clientPkey),
-          port((ca != NULL) ? 8883 : 1883),
-          queue(32 * EVENTS_EVENT_SIZE),                //TODO: Hardcoded 32  
+          credentials(aCredentials),
+          port((aCredentials != NULL) ? 8883 : 1883),
           isConnected(false),          
           hasSavedSession(false),
-          isDERformat(isDER),
-          useTLS(ca != NULL)
+          hostResolved(false),
+          sessionPresent(false),
+          reconnectDelay(0),
+          useTLS(aCredentials != NULL)
     {
-        tcpSocket = new TCPSocket(aNetwork);
+        memset(inflight, 0, sizeof(inflight));
+        memset(receivedQos2, 0, sizeof(receivedQos2));
+        receivedQos2Next = 0;
+        memset(&queueStats, 0, sizeof(queueStats));
+        memset(&tlsStats, 0, sizeof(tlsStats));
+        certVerified = false;
+        outHead = 0;
+        outCount = 0;
+        queuePolicy = QUEUE_FULL_BLOCK;
+        queueTimeout = MBED_CONF_APP_MQTT_QUEUE_TIMEOUT_MS;
+        spool = NULL;
+        subscriptionCount = 0;
+        readPending = 0;
+        pingOutstanding = false;
+        pingSentMs = 0;
+        tcpSocket = new TCPSocket();
         setupTLS();
     }
     
     ~MQTTThreadedClient()
     {
         // TODO: signal the thread to shutdown
+        // disconnect() still uses the SSL context, free it afterwards
+        disconnect();
+
         freeTLS();
-           
-        if (isConnected)
-            disconnect();
-                
+        if (credentials != NULL)
+            credentials->release();
+
+        delete tcpSocket;
     }
     /** 
      *  Sets the connection parameters. Must be called before running the startListener as a thread.
@@ -130,19 +288,78 @@ public:
      *  @param options - the connect data used for logging into the MQTT server.
      */
     void setConnectionParameters(const char * host, uint16_t port, MQTTPacket_connectData & options);
+    /**
+     *  Copies the message into the client's pool and queues it for sending.
+     */
     int publish(PubMessage& message);
+    /**
+     *  Takes a message from the client's pool so that the caller can fill the
+     *  topic and payload in place and queue it with publish(PubMessage *)
+     *  without copying. Returns NULL if the pool is exhausted.
+     */
+    PubMessage * allocMessage();
+    /**
+     *  Queues a message obtained from allocMessage(). The client owns the
+     *  message from here on and returns it to the pool once it has been sent,
+     *  also when queueing fails. A full queue is handled according to the
+     *  policy set with setQueuePolicy().
+     */
+    int publish(PubMessage * message);
+    /**
+     *  Same as publish() but never blocks; with QUEUE_FULL_BLOCK a full
+     *  queue returns TIMEOUT straight away.
+     */
+    int tryPublish(PubMessage& message);
+    int tryPublish(PubMessage * message);
+    /**
+     *  Publishes a latest-value message: if a message for the same topic
+     *  is still waiting in the queue it is replaced by this one, so only
+     *  the newest value per topic is sent. Never blocks. Latest-value
+     *  messages are never spooled, while offline only the newest one per
+     *  topic waits in the queue and it is sent ahead of the spool.
+     */
+    int publishLatest(PubMessage& message);
+    int publishLatest(PubMessage * message);
+    /**
+     *  Sets what publishing does when the outgoing queue is full and, for
+     *  QUEUE_FULL_BLOCK, how long publish() waits for room.
+     */
+    void setQueuePolicy(QueueFullPolicy policy, uint32_t timeout_ms = MBED_CONF_APP_MQTT_QUEUE_TIMEOUT_MS);
+    /**
+     *  Returns a snapshot of the outgoing queue counters.
+     */
+    QueueStats getQueueStats();
+    /**
+     *  Sets an opened spool that publishes are written to while the
+     *  client is disconnected, and replayed from in order once the
+     *  connection is back. Messages from publishLatest() are not spooled.
+     *  NULL disables spooling.
+     */
+    void setSpool(MQTTSpool * aSpool);
+    /**
+     *  Returns the counts of full and resumed TLS handshakes.
+     */
+    TLSStats getTLSStats();
+    /**
+     *  Returns an unused message obtained from allocMessage() to the pool.
+     */
+    void freeMessage(PubMessage * message);
     
 
-    void addTopicHandler(const char * topic, void (*function)(MessageData &));
+    /**
+     *  Subscribes to a topic filter, which may contain the + and #
+     *  wildcards, and calls function for every message matching it.
+     *  Several handlers can be added for the same filter. The SUBSCRIBE
+     *  is sent as soon as the client is connected and again after every
+     *  reconnect that does not find our session on the broker.
+     *  Returns SUCCESS, or BUFFER_OVERFLOW when the tables are full.
+     */
+    int addTopicHandler(const char * topic, void (*function)(MessageData &), QoS qos = QOS0);
 
     void startListener();
     
     void stopListener();
 
-    size_t ssl_ca_len;
-    size_t ssl_client_cert_len;
-    size_t ssl_client_pkey_len;
-
 protected:
 
     int handlePublishMsg();
@@ -152,11 +369,14 @@ protected:
 
 private:
     NetworkInterface * network;
-    const unsigned char * ssl_ca;
-    const unsigned char * ssl_client_cert;
-    const unsigned char * ssl_client_pkey;
-
+    TLSCredentials * credentials;
 
+    // Per connection TLS state, the credentials are shared
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _ctr_drbg;
+    mbedtls_ssl_context _ssl;
+    mbedtls_ssl_config _ssl_conf;
+    mbedtls_ssl_session saved_session;
 
     TCPSocket * tcpSocket;
     PacketId packetid;
@@ -166,27 +386,74 @@ private:
     std::string host;
     uint16_t port;
     MQTTPacket_connectData connect_options;
-    // Event queue
-    EventQueue queue;
+    // Wakes up the listener thread
+    EventFlags listenerFlags;
+    // Wakes up publishers blocked on a full queue
+    EventFlags queueFlags;
+
+    // Outgoing messages waiting to be sent, a ring of outCount
+    // entries starting at outHead, guarded by outMutex
+    PubMessage * outQueue[MBED_CONF_APP_MQTT_QUEUE_SIZE];
+    // Set for the entries of outQueue queued by publishLatest()
+    bool outLatest[MBED_CONF_APP_MQTT_QUEUE_SIZE];
+    int outHead;
+    int outCount;
+    // The pool must hold every queued message, every message that is still
+    // in flight waiting for its acknowledgement and the one a publisher is
+    // filling in while the queue is full.
+    MemoryPool<PubMessage, MBED_CONF_APP_MQTT_QUEUE_SIZE + MBED_CONF_APP_MQTT_MAX_INFLIGHT + 1> mpool;
+    Mutex outMutex;
+    QueueFullPolicy queuePolicy;
+    uint32_t queueTimeout;
+    QueueStats queueStats;
+    // Store-and-forward spool for publishes made while offline
+    MQTTSpool * spool;
     bool isConnected;
     bool hasSavedSession;    
-    bool isDERformat;
+    // Broker address, resolved once and kept until a connect to it fails
+    SocketAddress hostAddress;
+    bool hostResolved;
+    // The broker kept our session (clean session off) at the last CONNACK
+    bool sessionPresent;
+    // Current reconnect back off in ms, 0 until a reconnect fails
+    uint32_t reconnectDelay;
     
-    // TODO: Because I'm using a map, I can only have one handler
-    // for each topic (one that's mapped to the topic string).
-    // Attaching another handler on the same topic is not possible.
-    // In the future, use a vector instead of maps to allow multiple
-    // handlers for the same topic.
-    std::map<std::string, F_P<void, MessageData &> > topicCBMap;
+    // Topic handlers and the subscriptions behind them, guarded by
+    // subMutex as handlers may be added from any thread
+    TopicTrie topicHandlers;
+    Subscription subscriptions[MBED_CONF_APP_MQTT_MAX_HANDLERS];
+    int subscriptionCount;
+    Mutex subMutex;
     
-    unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
-    unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+    unsigned char sendbuf[MBED_CONF_APP_MQTT_SEND_BUFFER_SIZE];
+    unsigned char readbuf[MBED_CONF_APP_MQTT_READ_BUFFER_SIZE];
+    // Bytes of the PUBLISH in readbuf still to be read from the network
+    size_t readPending;
 
     unsigned int keepAliveInterval;
     Timer comTimer;
+    bool pingOutstanding;
+    int pingSentMs;
+
+    // Outgoing QoS1/QoS2 publishes awaiting acknowledgement
+    InFlightMessage inflight[MBED_CONF_APP_MQTT_MAX_INFLIGHT];
+    Timer retryTimer;
+    // Packet ids of inbound QoS2 publishes delivered but not yet
+    // released by PUBREL, 0 when free
+    unsigned short receivedQos2[MBED_CONF_APP_MQTT_MAX_INFLIGHT];
+    int receivedQos2Next;
 
     // SSL/TLS functions
     bool useTLS;
+    // Set by the verify callback when the server sent its certificate
+    bool certVerified;
+    TLSStats tlsStats;
+#if MBED_CONF_APP_MQTT_TLS_SESSION_PERSIST
+    unsigned char sessionKey[32];
+    bool hasSessionKey;
+    void loadSession();
+    void persistSession();
+#endif
     void setupTLS();
     int initTLS();    
     void freeTLS();
@@ -194,16 +461,41 @@ private:
     
     //int processSubscriptions();
     int readPacket();
+    int readAll(unsigned char * buffer, size_t length);
+    int discardBytes(size_t length);
     int sendPacket(size_t length);
+    int sendAll(const unsigned char * buffer, size_t length);
     int readPacketLength(int* value);
     int readUntil(int packetType, int timeout);
     int readBytesToBuffer(char * buffer, size_t size, int timeout);
     int sendBytesFromBuffer(char * buffer, size_t size, int timeout);
 //    bool isTopicMatched(char* topic, MQTTString& topicName);
-    int  sendPublish(PubMessage& message);
+    int  sendPublish(PubMessage& message, bool dup = false);
+    int  sendSubscriptions();
+    void resetSubscriptions(bool all);
+    int  handleSubAck();
+    int  sendAck(unsigned char type, unsigned short id);
+    int  handleAckMsg(int packetType);
+    int  findInFlight(unsigned short id);
+    int  findFreeInFlight();
+    int  retransmitInFlight(bool all);
+    bool markReceivedQos2(unsigned short id);
+    void releaseReceivedQos2(unsigned short id);
     void resetConnectionTimer();
-    void sendPingRequest();
+    int  sendPingRequest();
     bool hasConnectionTimedOut();
+    int  serviceKeepAlive();
+    uint32_t nextWakeup();
+    uint32_t nextReconnectDelay();
+    void onSocketEvent();
+    int  handlePacket(int pType);
+    int  enqueueMessage(PubMessage * message, uint32_t timeout_ms, bool latest = false);
+    int  findQueued(const char * topic);
+    PubMessage * removeQueued(int index);
+    PubMessage * dequeueMessage();
+    int  spoolQueuedMessages();
+    int  sendMessage(PubMessage * message, int slot);
+    int  sendQueuedMessages();
     int login();
 };
 
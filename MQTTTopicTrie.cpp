@@ -0,0 +1,152 @@
+#include "MQTTTopicTrie.h"
+#include "MQTTThreadedClient.h"
+
+namespace MQTT
+{
+
+TopicTrie::TopicTrie()
+    : nodeCount(1),
+      handlerCount(0),
+      arenaUsed(0)
+{
+    nodes[ROOT].child = NONE;
+    nodes[ROOT].sibling = NONE;
+    nodes[ROOT].handler = NONE;
+    nodes[ROOT].level = 0;
+    nodes[ROOT].levelLen = 0;
+}
+
+int TopicTrie::findChild(int node, const char * level, size_t len)
+{
+    for (int child = nodes[node].child; child != NONE; child = nodes[child].sibling)
+    {
+        if (nodes[child].levelLen == len && memcmp(&arena[nodes[child].level], level, len) == 0)
+            return child;
+    }
+
+    return NONE;
+}
+
+bool TopicTrie::isLevel(int node, char wildcard)
+{
+    return nodes[node].levelLen == 1 && arena[nodes[node].level] == wildcard;
+}
+
+int TopicTrie::add(const char * filter, Handler handler)
+{
+    int node = ROOT;
+    const char * level = filter;
+
+    if (handlerCount >= MBED_CONF_APP_MQTT_MAX_HANDLERS)
+        return BUFFER_OVERFLOW;
+
+    // Walk down the levels of the filter, adding the missing ones
+    while (true)
+    {
+        const char * sep = strchr(level, '/');
+        size_t len = (sep != NULL) ? (size_t) (sep - level) : strlen(level);
+
+        int child = findChild(node, level, len);
+        if (child == NONE)
+        {
+            if (nodeCount >= MAX_NODES || len > 0xFF || arenaUsed + len > sizeof(arena))
+                return BUFFER_OVERFLOW;
+
+            child = nodeCount++;
+            memcpy(&arena[arenaUsed], level, len);
+            nodes[child].level = arenaUsed;
+            nodes[child].levelLen = len;
+            nodes[child].child = NONE;
+            nodes[child].handler = NONE;
+            nodes[child].sibling = nodes[node].child;
+            nodes[node].child = child;
+            arenaUsed += len;
+        }
+        node = child;
+
+        if (sep == NULL)
+            break;
+        level = sep + 1;
+    }
+
+    // Append, so handlers are called in the order they were added
+    int entry = handlerCount++;
+    handlers[entry].fp = handler;
+    handlers[entry].next = NONE;
+
+    int16_t * link = &nodes[node].handler;
+    while (*link != NONE)
+        link = &handlers[*link].next;
+    *link = entry;
+
+    return SUCCESS;
+}
+
+int TopicTrie::callHandlers(int node, MessageData & md)
+{
+    int called = 0;
+
+    for (int entry = nodes[node].handler; entry != NONE; entry = handlers[entry].next)
+    {
+        if (handlers[entry].fp.attached())
+        {
+            handlers[entry].fp(md);
+            called++;
+        }
+    }
+
+    return called;
+}
+
+/**
+ * Matches the topic from level (NULL once all levels are used up)
+ * against the children of node.
+ **/
+int TopicTrie::match(int node, const char * level, const char * end, MessageData & md)
+{
+    int called = 0;
+
+    if (level == NULL)
+    {
+        // The whole topic matched; "a/#" also matches "a" itself
+        called += callHandlers(node, md);
+        for (int child = nodes[node].child; child != NONE; child = nodes[child].sibling)
+        {
+            if (isLevel(child, '#'))
+                called += callHandlers(child, md);
+        }
+        return called;
+    }
+
+    const char * sep = (const char *) memchr(level, '/', end - level);
+    size_t len = ((sep != NULL) ? sep : end) - level;
+    const char * next = (sep != NULL) ? sep + 1 : NULL;
+
+    // Wildcards at the first level do not match topics starting with $
+    bool wildcards = !(node == ROOT && len > 0 && level[0] == '$');
+
+    for (int child = nodes[node].child; child != NONE; child = nodes[child].sibling)
+    {
+        if (isLevel(child, '#'))
+        {
+            if (wildcards)
+                called += callHandlers(child, md);
+        }
+        else if (isLevel(child, '+'))
+        {
+            if (wildcards)
+                called += match(child, next, end, md);
+        }
+        else if (nodes[child].levelLen == len && memcmp(&arena[nodes[child].level], level, len) == 0)
+            called += match(child, next, end, md);
+    }
+
+    return called;
+}
+
+int TopicTrie::dispatch(const char * topic, size_t len, MessageData & md)
+{
+    return match(ROOT, topic, topic + len, md);
+}
+
+}
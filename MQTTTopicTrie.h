@@ -0,0 +1,83 @@
+#ifndef _MQTT_TOPIC_TRIE_H_
+#define _MQTT_TOPIC_TRIE_H_
+
+#include "mbed.h"
+#include "FP.h"
+
+// Number of topic handlers (and subscriptions) a client can hold
+#ifndef MBED_CONF_APP_MQTT_MAX_HANDLERS
+#define MBED_CONF_APP_MQTT_MAX_HANDLERS 8
+#endif
+
+// Bytes available for the topic levels of all subscribed filters
+#ifndef MBED_CONF_APP_MQTT_TOPIC_ARENA_SIZE
+#define MBED_CONF_APP_MQTT_TOPIC_ARENA_SIZE 256
+#endif
+
+namespace MQTT
+{
+
+struct MessageData;
+
+/**
+ * Topic filters and their handlers, stored as a trie with one node per
+ * topic level so that the + and # wildcards can be matched level by
+ * level. Everything lives in fixed tables, dispatching an inbound
+ * topic does not allocate.
+ **/
+class TopicTrie
+{
+public:
+    typedef F_P<void, MessageData &> Handler;
+
+    TopicTrie();
+
+    /**
+     *  Adds a handler for a topic filter. Several handlers can be added
+     *  for the same filter, they are called in the order they were added.
+     *  Returns SUCCESS, or BUFFER_OVERFLOW when the tables are full.
+     */
+    int add(const char * filter, Handler handler);
+
+    /**
+     *  Calls every handler whose filter matches the topic, which does
+     *  not have to be null terminated. Returns the number of handlers
+     *  called.
+     */
+    int dispatch(const char * topic, size_t len, MessageData & md);
+
+private:
+    static const int MAX_NODES = MBED_CONF_APP_MQTT_MAX_HANDLERS * 4;
+    static const int ROOT = 0;
+    static const int NONE = -1;
+
+    typedef struct
+    {
+        int16_t child;      // first child node
+        int16_t sibling;    // next node with the same parent
+        int16_t handler;    // first handler of a filter ending here
+        uint16_t level;     // offset of the level text in the arena
+        uint8_t levelLen;
+    } Node;
+
+    typedef struct
+    {
+        Handler fp;
+        int16_t next;       // next handler for the same filter
+    } HandlerEntry;
+
+    Node nodes[MAX_NODES];
+    int nodeCount;
+    HandlerEntry handlers[MBED_CONF_APP_MQTT_MAX_HANDLERS];
+    int handlerCount;
+    char arena[MBED_CONF_APP_MQTT_TOPIC_ARENA_SIZE];
+    size_t arenaUsed;
+
+    int  findChild(int node, const char * level, size_t len);
+    bool isLevel(int node, char wildcard);
+    int  callHandlers(int node, MessageData & md);
+    int  match(int node, const char * level, const char * end, MessageData & md);
+};
+
+}
+#endif
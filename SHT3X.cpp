@@ -0,0 +1,98 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "SHT3X.h"
+
+SHT3X::SHT3X (I2CBus& sht3x_i2c, uint8_t sht3x_addr):
+    _i2c(sht3x_i2c), _addr(sht3x_addr<<1)
+{
+    _periodic = false;
+}
+/*
+ *  Initialize SHT3X
+ *  Resets the sensor and, if periodic, starts its accelerated response
+ *  time mode, where it measures on its own at 4 Hz and read() only
+ *  fetches the latest result
+ */
+bool SHT3X::init(bool periodic)
+{
+    // After a warm reset the sensor may still be measuring periodically
+    // and NACK the soft reset, stop it first. There is nothing to stop
+    // after a cold start, so the result does not matter.
+    writeCommand(SHT3X_CMD_BREAK);
+    wait_ms(1);
+    if(!writeCommand(SHT3X_CMD_SOFT_RESET)) {
+        return false;
+    }
+    wait_ms(2);
+    writeCommand(SHT3X_CMD_HEATER_OFF);
+
+    _periodic = periodic;
+    if(_periodic) {
+        return writeCommand(SHT3X_CMD_PERIODIC_ART);
+    }
+    return true;
+}
+/*
+ *  Write Command
+ */
+bool SHT3X::writeCommand(uint16_t cmd)
+{
+    char write[] = {(char)(cmd >> 8), (char)(cmd & 0xFF)};
+    return _i2c.write(_addr, write, 2) == 0;
+}
+/*
+ *  CRC-8 of a data word as sent by the sensor
+ */
+uint8_t SHT3X::crc8(const char *data, int len)
+{
+    uint8_t crc = SHT3X_CRC_INIT;
+    for(int i=0; i<len; i++) {
+        crc ^= data[i];
+        for(uint8_t b=0; b<8; b++) {
+            crc = (crc & 0x80) ? (crc << 1) ^ SHT3X_CRC_POLY : (crc << 1);
+        }
+    }
+    return crc;
+}
+/*
+ *  Read Temperature and Humidity
+ *  Both come from one measurement in a single 6 byte frame. In single
+ *  shot mode the sensor stretches the clock until it is done. Returns
+ *  false, leaving the values unchanged, if the sensor did not answer
+ *  or a CRC does not match.
+ */
+bool SHT3X::read(float &temperature, float &humidity)
+{
+    char frame[SHT3X_FRAME_SIZE];
+
+    if(!writeCommand(_periodic ? SHT3X_CMD_FETCH : SHT3X_CMD_SINGLE_HIGH_STRETCH)) {
+        return false;
+    }
+    if(_i2c.read(_addr, frame, SHT3X_FRAME_SIZE) != 0) {
+        return false;
+    }
+    if((crc8(&frame[0], 2) != (uint8_t)frame[2]) || (crc8(&frame[3], 2) != (uint8_t)frame[5])) {
+        return false;
+    }
+
+    uint16_t rawT = ((uint8_t)frame[0] << 8) | (uint8_t)frame[1];
+    uint16_t rawRH = ((uint8_t)frame[3] << 8) | (uint8_t)frame[4];
+    temperature = -45.0F + 175.0F * rawT / 65535.0F;
+    humidity = 100.0F * rawRH / 65535.0F;
+    return true;
+}
@@ -0,0 +1,55 @@
+/* mbed Microcontroller Library
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef SHT3X_H
+#define SHT3X_H
+
+#include "mbed.h"
+#include "I2CBus.h"
+
+#define SHT3X_ADDR          (0x44)
+
+#define SHT3X_FRAME_SIZE    (6)     // T msb, lsb, crc, RH msb, lsb, crc
+#define SHT3X_CRC_POLY      (0x31)
+#define SHT3X_CRC_INIT      (0xFF)
+
+enum {
+    SHT3X_CMD_SINGLE_HIGH_STRETCH   = 0x2C06,
+    SHT3X_CMD_PERIODIC_ART          = 0x2B32,
+    SHT3X_CMD_FETCH                 = 0xE000,
+    SHT3X_CMD_BREAK                 = 0x3093,
+    SHT3X_CMD_SOFT_RESET            = 0x30A2,
+    SHT3X_CMD_HEATER_OFF            = 0x3066,
+};
+
+class SHT3X
+{
+    public:
+    SHT3X(I2CBus& sht3x_i2c, uint8_t sht3x_addr=SHT3X_ADDR);
+    bool init(bool periodic=false);
+    bool read(float &temperature, float &humidity);
+
+    protected:
+    I2CBus                      &_i2c;
+    uint8_t                     _addr;
+    bool                        _periodic;
+
+    bool writeCommand(uint16_t cmd);
+    static uint8_t crc8(const char *data, int len);
+};
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef _SAMPLE_RING_H_
+#define _SAMPLE_RING_H_
+
+#include "mbed.h"
+
+// Samples kept per sensor channel, must be a power of 2
+#ifndef MBED_CONF_APP_SAMPLE_HISTORY_SIZE
+#define MBED_CONF_APP_SAMPLE_HISTORY_SIZE 64
+#endif
+
+/**
+ * Fixed size ring of (time, value) samples of one sensor channel.
+ *
+ * A single producer pushes samples, overwriting the oldest one when
+ * the ring is full, and never waits. Samples are numbered by a free
+ * running sequence; readers keep their own cursor into it and never
+ * write to the ring, so they need no lock either. After copying a
+ * sample a reader checks that the producer has not come round to its
+ * slot meanwhile, and a reader that fell too far behind skips ahead to
+ * the oldest sample still held. Up to N - 1 samples can be read back.
+ **/
+template <uint32_t N>
+class SampleRing
+{
+    // the sequence wraps at 2^32, which N has to divide
+    typedef char sizeIsPowerOf2[(N & (N - 1)) == 0 ? 1 : -1];
+
+public:
+    typedef struct
+    {
+        long long time;     // of the reading, ms since the epoch
+        int32_t value;
+    } Entry;
+
+    SampleRing() : head(0), held(0) {}
+
+    /**
+     *  Adds a sample, only ever called from the producer thread.
+     */
+    void push(long long time, int32_t value)
+    {
+        Entry & e = entries[head % N];
+        e.time = time;
+        e.value = value;
+
+        // The entry must be complete before readers can see it
+        __DMB();
+        head = head + 1;
+        if (held < N - 1)
+            held = held + 1;
+    }
+
+    /**
+     *  Cursor of the newest count samples, or of all held ones if
+     *  there are fewer.
+     */
+    uint32_t cursor(uint32_t count) const
+    {
+        // held only grows and trails head, reading it first keeps the
+        // cursor within what has been pushed
+        uint32_t n = held;
+        __DMB();
+        if (count > n)
+            count = n;
+        return head - count;
+    }
+
+    /**
+     *  Copies the sample at cursor and moves the cursor past it.
+     *  Returns false, leaving out untouched, when there is no newer
+     *  sample.
+     */
+    bool read(uint32_t & at, Entry & out) const
+    {
+        while (true)
+        {
+            uint32_t h = head;
+            __DMB();
+
+            if (h - at >= N)
+                at = h - (N - 1);
+            if (at == h)
+                return false;
+
+            Entry copy = entries[at % N];
+            __DMB();
+
+            // The slot is rewritten by push number at + N, which
+            // starts once head reaches it
+            if (head - at < N)
+            {
+                out = copy;
+                at++;
+                return true;
+            }
+        }
+    }
+
+private:
+    Entry entries[N];
+    volatile uint32_t head;
+    volatile uint32_t held;     // samples pushed, up to N - 1
+};
+
+#endif
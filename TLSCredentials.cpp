@@ -0,0 +1,156 @@
+#include "TLSCredentials.h"
+#include "MQTTThreadedClient.h"
+#include "mbedtls/platform.h"
+#include "mbedtls/md.h"
+
+namespace MQTT
+{
+
+TLSCredentials::TLSCredentials(const unsigned char * ca, size_t caLen,
+                               const unsigned char * clientCert, size_t clientCertLen,
+                               const unsigned char * clientPkey, size_t clientPkeyLen,
+                               bool isDER)
+    : ssl_ca(ca),
+      ssl_client_cert(clientCert),
+      ssl_client_pkey(clientPkey),
+      ssl_ca_len(caLen),
+      ssl_client_cert_len(clientCertLen),
+      ssl_client_pkey_len(clientPkeyLen),
+      isDERformat(isDER),
+      parsed(false),
+      refCount(0)
+{
+    // PEM includes the terminating null in the length it is parsed with
+    if (!isDERformat)
+    {
+        ssl_ca_len = strlen((const char *) ssl_ca) + 1;
+        ssl_client_cert_len = strlen((const char *) ssl_client_cert) + 1;
+        ssl_client_pkey_len = strlen((const char *) ssl_client_pkey) + 1;
+    }
+
+    mbedtls_x509_crt_init(&cacert);
+    mbedtls_x509_crt_init(&clientcert);
+    mbedtls_pk_init(&pkey);
+}
+
+TLSCredentials::~TLSCredentials()
+{
+    mbedtls_x509_crt_free(&cacert);
+    mbedtls_x509_crt_free(&clientcert);
+    mbedtls_pk_free(&pkey);
+}
+
+void TLSCredentials::retain()
+{
+    mutex.lock();
+    refCount++;
+    mutex.unlock();
+}
+
+void TLSCredentials::release()
+{
+    mutex.lock();
+    bool last = (--refCount == 0);
+    mutex.unlock();
+
+    if (last)
+        delete this;
+}
+
+int TLSCredentials::parse()
+{
+    int ret = 0;
+
+    mutex.lock();
+    if (parsed)
+    {
+        mutex.unlock();
+        return 0;
+    }
+
+    DBG("TLSCredentials::parse() ...\r\n");
+    if (isDERformat)
+    {
+        DBG("-->DER mbedtls_x509_crt_parse ca cert ...\r\n");
+        if ((ret = mbedtls_x509_crt_parse_der(&cacert, ssl_ca, ssl_ca_len)) != 0)
+        {
+            mbedtls_printf("ERROR mbedtls_x509_crt_parse_der() ca cert returned [%x]\r\n", ret);
+            goto exit;
+        }
+
+        DBG("-->DER mbedtls_x509_crt_parse client cert ...\r\n");
+        if ((ret = mbedtls_x509_crt_parse_der(&clientcert, ssl_client_cert, ssl_client_cert_len)) != 0)
+        {
+            mbedtls_printf("ERROR mbedtls_x509_crt_parse_der() client cert returned [%x]\r\n", ret);
+            goto exit;
+        }
+    }
+    else
+    {
+        DBG("-->PEM mbedtls_x509_crt_parse ca cert ...\r\n");
+        if ((ret = mbedtls_x509_crt_parse(&cacert, ssl_ca, ssl_ca_len)) != 0)
+        {
+            mbedtls_printf("mbedtls_x509_crt_parse ca cert returned [%x]\r\n", ret);
+            goto exit;
+        }
+
+        DBG("-->PEM mbedtls_x509_crt_parse client cert ...\r\n");
+        if ((ret = mbedtls_x509_crt_parse(&clientcert, ssl_client_cert, ssl_client_cert_len)) != 0)
+        {
+            mbedtls_printf("mbedtls_x509_crt_parse client cert returned [%x]\r\n", ret);
+            goto exit;
+        }
+    }
+
+    DBG("-->PEM or DER mbedtls_pk_parse_key ...\r\n");
+    if ((ret = mbedtls_pk_parse_key(&pkey, ssl_client_pkey, ssl_client_pkey_len, NULL, 0)) != 0)
+    {
+        mbedtls_printf("mbedtls_pk_parse_key returned [%x]\r\n", ret);
+        goto exit;
+    }
+
+    parsed = true;
+
+exit:
+    if (!parsed)
+    {
+        // Start over cleanly on the next attempt
+        mbedtls_x509_crt_free(&cacert);
+        mbedtls_x509_crt_free(&clientcert);
+        mbedtls_pk_free(&pkey);
+        mbedtls_x509_crt_init(&cacert);
+        mbedtls_x509_crt_init(&clientcert);
+        mbedtls_pk_init(&pkey);
+    }
+    mutex.unlock();
+
+    return ret;
+}
+
+int TLSCredentials::deriveKey(const char * label, unsigned char key[32])
+{
+    const mbedtls_md_info_t * sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    unsigned char salt[32] = {0};
+    unsigned char prk[32];
+    unsigned char info[64];
+    size_t infoLen = strlen(label);
+    int ret;
+
+    if (infoLen + 1 > sizeof(info))
+        return MBEDTLS_ERR_MD_BAD_INPUT_DATA;
+
+    // RFC 5869 with no salt: extract, then expand one block with the label
+    ret = mbedtls_md_hmac(sha256, salt, sizeof(salt),
+                          ssl_client_pkey, ssl_client_pkey_len, prk);
+    if (ret == 0)
+    {
+        memcpy(info, label, infoLen);
+        info[infoLen] = 0x01;
+        ret = mbedtls_md_hmac(sha256, prk, sizeof(prk), info, infoLen + 1, key);
+    }
+    memset(prk, 0, sizeof(prk));
+
+    return ret;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef _TLS_CREDENTIALS_H_
+#define _TLS_CREDENTIALS_H_
+
+#include "mbed.h"
+#include "rtos.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+namespace MQTT
+{
+
+/**
+ * CA certificate, client certificate and private key of a TLS client,
+ * parsed once and shared by every MQTTThreadedClient that uses them.
+ *
+ * The object is reference counted: each client retains it while it
+ * exists and the last release() deletes it, so it must be allocated
+ * with new. The parsed contexts are only read after parse(), which
+ * makes them safe to use from several listener threads.
+ **/
+class TLSCredentials
+{
+public:
+    /**
+     *  @param ca, clientCert, clientPkey - the credentials, DER or PEM
+     *  @param caLen, clientCertLen, clientPkeyLen - their lengths in bytes,
+     *         only needed for DER, PEM strings are measured with strlen
+     *  @param isDER - true if the credentials are DER encoded
+     */
+    TLSCredentials(const unsigned char * ca, size_t caLen,
+                   const unsigned char * clientCert, size_t clientCertLen,
+                   const unsigned char * clientPkey, size_t clientPkeyLen,
+                   bool isDER = false);
+
+    /**
+     *  Parses the credentials, only the first call does any work.
+     *  Returns 0 on success or the mbedTLS error.
+     */
+    int parse();
+
+    void retain();
+    void release();
+
+    mbedtls_x509_crt * caChain() { return &cacert; }
+    mbedtls_x509_crt * ownCert() { return &clientcert; }
+    mbedtls_pk_context * ownKey() { return &pkey; }
+
+    /**
+     *  Derives a 256-bit key for the purpose named by label from the
+     *  private key, a secret only this device has, with HKDF-SHA256.
+     *  Different labels give unrelated keys.
+     *  Returns 0 on success or the mbedTLS error.
+     */
+    int deriveKey(const char * label, unsigned char key[32]);
+
+private:
+    ~TLSCredentials();
+
+    const unsigned char * ssl_ca;
+    const unsigned char * ssl_client_cert;
+    const unsigned char * ssl_client_pkey;
+    size_t ssl_ca_len;
+    size_t ssl_client_cert_len;
+    size_t ssl_client_pkey_len;
+    bool isDERformat;
+
+    mbedtls_x509_crt cacert;
+    mbedtls_x509_crt clientcert;
+    mbedtls_pk_context pkey;
+
+    Mutex mutex;
+    bool parsed;
+    int refCount;
+};
+
+}
+#endif
@@ -16,12 +16,13 @@
 
 #include "TSL2591.h"
 
-TSL2591::TSL2591 (I2C& tsl2591_i2c, uint8_t tsl2591_addr):
+TSL2591::TSL2591 (I2CBus& tsl2591_i2c, uint8_t tsl2591_addr):
     _i2c(tsl2591_i2c), _addr(tsl2591_addr<<1)
 {
     _init = false;
     _integ = TSL2591_INTT_100MS;
     _gain = TSL2591_GAIN_LOW;
+    _autoRange = false;
 }
 /*
  *  Initialize TSL2591
@@ -30,9 +31,8 @@ TSL2591::TSL2591 (I2C& tsl2591_i2c, uint8_t tsl2591_addr):
 bool TSL2591::init(void)
 {
     char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_ID)};
-    if(_i2c.write(_addr, write, 1, 0) == 0) {
-        char read[1];
-        _i2c.read(_addr, read, 1, 0);
+    char read[1];
+    if(_i2c.writeRead(_addr, write, 1, read, 1) == 0) {
         if(read[0] == TSL2591_ID) {
             _init = true;
             setGain(TSL2591_GAIN_LOW);
@@ -49,7 +49,7 @@ bool TSL2591::init(void)
 void TSL2591::enable(void)
 {
     char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_ENABLE), (TSL2591_EN_PON|TSL2591_EN_AEN|TSL2591_EN_AIEN|TSL2591_EN_NPIEN)};
-    _i2c.write(_addr, write, 2, 0);
+    _i2c.write(_addr, write, 2);
 }
 /*
  *  Power Off TSL2591
@@ -57,7 +57,7 @@ void TSL2591::enable(void)
 void TSL2591::disable(void)
 {
     char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_ENABLE), (TSL2591_EN_POFF)};
-    _i2c.write(_addr, write, 2, 0);
+    _i2c.write(_addr, write, 2);
 }
 /*
  *  Set Gain and Write
@@ -68,7 +68,7 @@ void TSL2591::setGain(tsl2591Gain_t gain)
     enable();
     _gain = gain;
     char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_CONTROL), (char)(_integ|_gain)};
-    _i2c.write(_addr, write, 2, 0);
+    _i2c.write(_addr, write, 2);
     disable();
 }
 /*
@@ -80,42 +80,154 @@ void TSL2591::setTime(tsl2591IntegrationTime_t integ)
     enable();
     _integ = integ;
     char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_CONTROL), (char)(_integ|_gain)};
-    _i2c.write(_addr, write, 2, 0);
+    _i2c.write(_addr, write, 2);
     disable();
 }
+/*
+ *  Set Gain and Integration Time and Write
+ *  Set both with a single write of the control register
+ */
+void TSL2591::setRange(tsl2591Gain_t gain, tsl2591IntegrationTime_t integ)
+{
+    enable();
+    _gain = gain;
+    _integ = integ;
+    char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_CONTROL), (char)(_integ|_gain)};
+    _i2c.write(_addr, write, 2);
+    disable();
+}
+/*
+ *  Set Auto Range
+ *  When enabled calcLux() picks the gain and integration time of the
+ *  next measurement from the counts of the last one
+ */
+void TSL2591::setAutoRange(bool autoRange)
+{
+    _autoRange = autoRange;
+}
 /*
  *  Read ALS
- *  Read full spectrum, infrared, and visible
+ *  Read full spectrum, infrared, and visible, waiting for the
+ *  integration to complete
  */
 void TSL2591::getALS(void)
+{
+    wait_ms(startALS());
+    readALS();
+}
+/*
+ *  Start ALS
+ *  Power on to start an integration without waiting for it, returns
+ *  the time in ms until readALS() has a complete result
+ */
+int TSL2591::startALS(void)
 {
     enable();
-    for(uint8_t t=0; t<=_integ+1; t++) {
-        wait(0.12);
-    }
+    return (_integ + 2) * 120;
+}
+/*
+ *  ALS Valid
+ *  Check if an integration has completed since the power on
+ */
+bool TSL2591::isALSValid(void)
+{
+    char write[] = {(TSL2591_CMD_BIT|TSL2591_REG_STATUS)};
+    char read[1] = {0};
+    _i2c.writeRead(_addr, write, 1, read, 1);
+    return (read[0] & TSL2591_STATUS_AVALID) != 0;
+}
+/*
+ *  Read ALS Result
+ *  Read full spectrum, infrared, and visible of the last integration
+ *  and power off
+ */
+void TSL2591::readALS(void)
+{
     char write1[] = {(TSL2591_CMD_BIT|TSL2591_REG_CHAN1_L)};
-    _i2c.write(_addr, write1, 1, 0);
     char read1[2];
-    _i2c.read(_addr, read1, 2, 0);
+    _i2c.writeRead(_addr, write1, 1, read1, 2);
     char write2[] = {(TSL2591_CMD_BIT|TSL2591_REG_CHAN0_L)};
-    _i2c.write(_addr, write2, 1, 0);
     char read2[2];
-    _i2c.read(_addr, read2, 2, 0);
+    _i2c.writeRead(_addr, write2, 1, read2, 2);
     rawALS = (((read1[1]<<8)|read1[0])<<16)|((read2[1]<<8)|read2[0]);
     disable();
     full = rawALS & 0xFFFF;
     ir = rawALS >> 16;
     visible = full - ir;
 }
+/*
+ *  Ranges from the least to the most sensitive, the gain is raised
+ *  first as it is free while a longer integration costs time
+ */
+static const struct {
+    tsl2591Gain_t gain;
+    tsl2591IntegrationTime_t integ;
+    float sensitivity;    // gain * integration time in ms
+} tsl2591Ranges[] = {
+    {TSL2591_GAIN_LOW,  TSL2591_INTT_100MS,       1.0F * 100},
+    {TSL2591_GAIN_MED,  TSL2591_INTT_100MS,      25.0F * 100},
+    {TSL2591_GAIN_HIGH, TSL2591_INTT_100MS,     428.0F * 100},
+    {TSL2591_GAIN_MAX,  TSL2591_INTT_100MS,    9876.0F * 100},
+    {TSL2591_GAIN_MAX,  TSL2591_INTT_200MS,    9876.0F * 200},
+    {TSL2591_GAIN_MAX,  TSL2591_INTT_300MS,    9876.0F * 300},
+    {TSL2591_GAIN_MAX,  TSL2591_INTT_400MS,    9876.0F * 400},
+    {TSL2591_GAIN_MAX,  TSL2591_INTT_500MS,    9876.0F * 500},
+    {TSL2591_GAIN_MAX,  TSL2591_INTT_600MS,    9876.0F * 600},
+};
+#define TSL2591_RANGES (sizeof(tsl2591Ranges) / sizeof(tsl2591Ranges[0]))
+
+static uint16_t maxCount(tsl2591IntegrationTime_t integ)
+{
+    return integ == TSL2591_INTT_100MS ? TSL2591_MAX_COUNT_100MS : TSL2591_MAX_COUNT;
+}
+/*
+ *  Adjust Range
+ *  Scale the last counts to every range and pick the least sensitive
+ *  one that still gives an adequate count while staying clear of
+ *  saturation, or the most sensitive one that stays clear of it in
+ *  the dark. After a saturated reading step to the least sensitive
+ *  range so the next one is sure to be usable.
+ */
+void TSL2591::adjustRange(void)
+{
+    size_t cur = 0;
+    for(size_t r=0; r<TSL2591_RANGES; r++) {
+        if((tsl2591Ranges[r].gain == _gain) && (tsl2591Ranges[r].integ == _integ)) {
+            cur = r;
+            break;
+        }
+    }
+
+    size_t next = 0;
+    if(full < maxCount(_integ)) {
+        for(size_t r=0; r<TSL2591_RANGES; r++) {
+            float predicted = (float)full * tsl2591Ranges[r].sensitivity / tsl2591Ranges[cur].sensitivity;
+            if(predicted >= TSL2591_RANGE_HEADROOM * maxCount(tsl2591Ranges[r].integ)) {
+                break;
+            }
+            next = r;
+            if(predicted >= TSL2591_RANGE_MIN_COUNT) {
+                break;
+            }
+        }
+    }
+
+    if(next != cur) {
+        setRange(tsl2591Ranges[next].gain, tsl2591Ranges[next].integ);
+    }
+}
 /*
  *  Calculate Lux
+ *  Returns false, leaving lux unchanged, if the reading was saturated
  */
-void TSL2591::calcLux(void)
+bool TSL2591::calcLux(void)
 {
     float atime, again, cpl, lux1, lux2, lux3;
-    if((full == 0xFFFF)|(ir == 0xFFFF)) {
-        lux3 = 0;
-        return;
+    if((full >= maxCount(_integ))|(ir >= maxCount(_integ))) {
+        if(_autoRange) {
+            adjustRange();
+        }
+        return false;
     }
     switch(_integ) {
         case TSL2591_INTT_100MS:
@@ -162,4 +274,8 @@ void TSL2591::calcLux(void)
     lux2 = (( TSL2591_LUX_COEFC * (float)full ) - ( TSL2591_LUX_COEFD * (float)ir)) / cpl;
     lux3 = lux1 > lux2 ? lux1 : lux2;
     lux = (uint32_t)lux3;
+    if(_autoRange) {
+        adjustRange();
+    }
+    return true;
 }
@@ -18,6 +18,7 @@
 #define TSL2591_H
 
 #include "mbed.h"
+#include "I2CBus.h"
 
 #define TSL2591_ADDR        (0x29)
 #define TSL2591_ID          (0x50)
@@ -31,6 +32,13 @@
 #define TSL2591_EN_PON      (0x01)
 #define TSL2591_EN_POFF     (0x00)
 
+#define TSL2591_STATUS_AVALID (0x01)
+
+#define TSL2591_MAX_COUNT_100MS  (36863)  // ADC full scale at 100 ms
+#define TSL2591_MAX_COUNT        (65535)  // and at longer integrations
+#define TSL2591_RANGE_MIN_COUNT  (1000)   // counts for an adequate resolution
+#define TSL2591_RANGE_HEADROOM   (0.8F)   // fraction of full scale to stay under
+
 #define TSL2591_LUX_DF      (408.0F)
 #define TSL2591_LUX_COEFB   (1.64F)  // CH0 coefficient 
 #define TSL2591_LUX_COEFC   (0.59F)  // CH1 coefficient A
@@ -95,14 +103,18 @@ typedef enum {
 class TSL2591
 {
     public:
-    TSL2591(I2C& tsl2591_i2c, uint8_t tsl2591_addr=TSL2591_ADDR);
+    TSL2591(I2CBus& tsl2591_i2c, uint8_t tsl2591_addr=TSL2591_ADDR);
     bool init(void);
     void enable(void);
     void disable(void);
     void setGain(tsl2591Gain_t gain);
     void setTime(tsl2591IntegrationTime_t integ);
     void getALS(void);
-    void calcLux(void);
+    int startALS(void);
+    bool isALSValid(void);
+    void readALS(void);
+    bool calcLux(void);
+    void setAutoRange(bool autoRange);
     volatile uint32_t           rawALS;
     volatile uint16_t           ir;
     volatile uint16_t           full;
@@ -110,11 +122,15 @@ class TSL2591
     volatile uint32_t           lux;
     
     protected:
-    I2C                         &_i2c;
+    I2CBus                      &_i2c;
     uint8_t                     _addr;
     bool                        _init;
     tsl2591Gain_t               _gain;
     tsl2591IntegrationTime_t    _integ;
+    bool                        _autoRange;
+
+    void setRange(tsl2591Gain_t gain, tsl2591IntegrationTime_t integ);
+    void adjustRange(void);
 };
 
 #endif
\ No newline at end of file
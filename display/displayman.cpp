@@ -30,7 +30,8 @@ DisplayMan::DisplayMan() :
 
 int DisplayMan::init(const std::string &version)
 {
-    _version_string = version;
+    /* the top line never changes, format it once */
+    _version_line = "Version: " + version;
     led_setup();
     led_set_color(IND_POWER, IND_COLOR_ON);
     _lcd.setBacklight(TextLCD_I2C::LightOn);
@@ -45,97 +46,129 @@ int DisplayMan::init(const std::string &version)
 
 void DisplayMan::set_downloading()
 {
+    _mutex.lock();
     _view_mode = DISPLAY_VIEW_DOWNLOAD;
     led_set_color(IND_FWUP, IND_COLOR_IN_PROGRESS, IND_FLAG_BLINK);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_download_complete()
 {
+    _mutex.lock();
     led_set_color(IND_FWUP, IND_COLOR_SUCCESS);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_progress(const std::string &message, uint32_t progress,
                               uint32_t total)
 {
+    _mutex.lock();
     _lcd_prog.set_progress(message, progress, total);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_cloud_registered()
 {
+    _mutex.lock();
     led_set_color(IND_CLOUD, IND_COLOR_SUCCESS);
     _cloud_registered = true;
+    _mutex.unlock();
 }
 
 void DisplayMan::set_cloud_unregistered()
 {
+    _mutex.lock();
     led_set_color(IND_CLOUD, IND_COLOR_OFF);
     _cloud_registered = false;
+    _mutex.unlock();
 }
 
 void DisplayMan::set_installing()
 {
+    _mutex.lock();
     _view_mode = DISPLAY_VIEW_INSTALL;
     _lcd.printline(0, "Installing...    ");
     _lcd.printline(1, "");
     led_set_color(IND_FWUP, IND_COLOR_SUCCESS);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_erasing()
 {
+    _mutex.lock();
     _view_mode = DISPLAY_VIEW_DOWNLOAD;
     _lcd.printline(0, "Factory Reset...    ");
     _lcd.printline(1, "");
+    _mutex.unlock();
 }
 
 void DisplayMan::set_default_view()
 {
+    _mutex.lock();
     _view_mode = DISPLAY_VIEW_SENSOR;
+    _mutex.unlock();
 }
 
 void DisplayMan::set_cloud_error()
 {
+    _mutex.lock();
     led_set_color(IND_CLOUD, IND_COLOR_FAILED);
     _cloud_registered = false;
+    _mutex.unlock();
 }
 
 void DisplayMan::init_network(const char *type)
 {
+    _mutex.lock();
     if (UINT8_MAX == _network_sensor_id) {
         _network_sensor_id = register_sensor(type);
     } else {
         set_sensor_name(_network_sensor_id, type);
     }
+    _mutex.unlock();
 }
 
 void DisplayMan::set_network_status(const std::string status)
 {
+    _mutex.lock();
     set_sensor_status(_network_sensor_id, status);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_network_connecting()
 {
+    _mutex.lock();
     led_set_color(IND_WIFI, IND_COLOR_IN_PROGRESS, IND_FLAG_BLINK);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_network_scanning()
 {
+    _mutex.lock();
     led_set_color(IND_WIFI, IND_COLOR_SUCCESS, IND_FLAG_BLINK);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_network_fail()
 {
+    _mutex.lock();
     led_set_color(IND_WIFI, IND_COLOR_FAILED);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_network_success()
 {
+    _mutex.lock();
     led_set_color(IND_WIFI, IND_COLOR_SUCCESS);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_cloud_in_progress()
 {
+    _mutex.lock();
     led_set_color(IND_CLOUD, IND_COLOR_IN_PROGRESS, IND_FLAG_BLINK);
     _cloud_registered = false;
+    _mutex.unlock();
 }
 
 uint8_t DisplayMan::register_sensor(const std::string &name, enum INDICATOR_TYPES indicator)
@@ -146,13 +179,15 @@ uint8_t DisplayMan::register_sensor(const std::string &name, enum INDICATOR_TYPE
     s.status = "";
     s.indicator = indicator;
 
+    _mutex.lock();
     if (indicator < IND_NO_TYPES) {
         led_set_color(indicator, IND_COLOR_SUCCESS_DIM);
     }
-
     _sensors.push_back(s);
+    uint8_t id = _sensors.size() - 1;
+    _mutex.unlock();
 
-    return _sensors.size() - 1;
+    return id;
 }
 
 struct DisplayMan::SensorDisplay *
@@ -185,14 +220,11 @@ void DisplayMan::set_sensor_status(struct SensorDisplay *s,
 
 void DisplayMan::set_sensor_status(uint8_t sensor_id, const std::string status)
 {
-    struct SensorDisplay *s;
-
-    if (sensor_id >= _sensors.size()) {
-        return;
+    _mutex.lock();
+    if (sensor_id < _sensors.size()) {
+        set_sensor_status(&_sensors[sensor_id], status);
     }
-
-    s = &_sensors[sensor_id];
-    set_sensor_status(s, status);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_sensor_status(const std::string name,
@@ -200,19 +232,21 @@ void DisplayMan::set_sensor_status(const std::string name,
 {
     struct SensorDisplay *s;
 
+    _mutex.lock();
     s = find_sensor(name);
-    if (NULL == s) {
-        return;
+    if (NULL != s) {
+        set_sensor_status(s, status);
     }
-
-    set_sensor_status(s, status);
+    _mutex.unlock();
 }
 
 void DisplayMan::set_sensor_name(uint8_t sensor_id, const std::string name)
 {
+    _mutex.lock();
     if (sensor_id < _sensors.size()) {
         _sensors[sensor_id].name = name;
     }
+    _mutex.unlock();
 }
 
 void DisplayMan::cycle_status()
@@ -220,8 +254,7 @@ void DisplayMan::cycle_status()
     char line[17];
 
     /* top line */
-    snprintf(line, sizeof(line), "Version: %s", _version_string.c_str());
-    _lcd.printline(0, line);
+    _lcd.printline(0, _version_line.c_str());
 
     /* bottom line */
     if (_sensors.size() > 0) {
@@ -235,6 +268,7 @@ void DisplayMan::cycle_status()
 
 void DisplayMan::refresh()
 {
+    _mutex.lock();
     led_post();
 
     if (_view_mode == DISPLAY_VIEW_SENSOR) {
@@ -251,6 +285,7 @@ void DisplayMan::refresh()
     }
 
     _cycle_count++;
+    _mutex.unlock();
 }
 
 #if MBED_CONF_APP_SELF_TEST
@@ -264,7 +299,9 @@ void DisplayMan::self_test()
         led_set_color(indicators[i], IND_COLOR_IN_PROGRESS);
     }
     for (i = 0; i <= 90; i++) {
+        _mutex.lock();
         _view_mode = DISPLAY_VIEW_SELF_TEST;
+        _mutex.unlock();
         set_progress("Self test", i, 90);
         refresh();
         Thread::wait(10);
@@ -31,6 +31,8 @@
 #include "ledman.h"
 #include "multiaddrlcd.h"
 
+#include "rtos.h"
+
 #include <string>
 #include <vector>
 
@@ -92,11 +94,16 @@ private:
     uint8_t _network_sensor_id;
     uint8_t _active_sensor;
     enum ViewMode _view_mode;
-    std::string _version_string;
+    std::string _version_line;
     bool _cloud_registered;
 
     uint64_t _cycle_count;
 
+    /* the display is refreshed from its own thread while the others
+     * update what it shows; every setter takes it, and it is recursive
+     * so setters can call each other */
+    Mutex _mutex;
+
     struct SensorDisplay *find_sensor(const std::string &name);
     void set_sensor_status(struct SensorDisplay *s, const std::string);
 };
@@ -17,7 +17,7 @@
 #include "lcdprogress.h"
 
 LCDProgress::LCDProgress(MultiAddrLCD &lcd)
-    : _lcd(lcd), _buffer(""), _previous("")
+    : _lcd(lcd), _buffer("")
 {
     char backslash[] = {0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x00, 0x00};
     lcd.setUDC(7, backslash);
@@ -82,19 +82,7 @@ void LCDProgress::set_progress(const std::string &message, uint32_t progress,
 
 void LCDProgress::refresh()
 {
-    if (_previous.length() == 0) {
-        /* No previous state, splat the whole thing. */
-        _lcd.printf("%s", _buffer.c_str());
-    } else {
-        /* Only change the characters that need changing to speed up update. */
-        for (int i = 0; i < 32; i++) {
-            if (_buffer[i] != _previous[i]) {
-                _lcd.locate(i % 16, i / 16);
-                _lcd.putc(_buffer[i]);
-            }
-        }
-    }
-    _previous = _buffer;
+    /* The LCD only sends the characters that changed. */
+    _lcd.locate(0, 0);
+    _lcd.printf("%s", _buffer.c_str());
 }
-
-void LCDProgress::reset() { _previous.clear(); }
@@ -35,12 +35,10 @@ public:
     void set_progress(const std::string &message, uint32_t progress,
                       uint32_t total);
     void refresh();
-    void reset();
 
 private:
     MultiAddrLCD &_lcd;
     std::string _buffer;
-    std::string _previous;
 };
 
 #endif
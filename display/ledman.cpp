@@ -24,9 +24,25 @@
 #include "ledman.h"
 #include "../compat.h"
 
-#include "PCA9956A.h"
-#include "PinNames.h"
-#include <vector>
+#include "../I2CBus.h"
+
+/* PCA9956A LED controller, the LEDs are on outputs 0 to 20 with three
+ * consecutive outputs (red, green, blue) per LED.
+ */
+#define PCA9956A_ADDR 0x02 /* 8-bit address */
+#define PCA9956A_MODE1 0x00
+#define PCA9956A_LEDOUT0 0x02
+#define PCA9956A_LEDOUT_REGS 6
+#define PCA9956A_LEDOUT_PWM 0xAA /* individual PWM control on all 4 outputs */
+#define PCA9956A_PWM0 0x0A
+#define PCA9956A_IREF0 0x22
+#define PCA9956A_AUTO_INCREMENT 0x80
+#define PCA9956A_IREF_MAX 0xFF
+#define LED_PORT(led, channel) ((led) * 3 + (channel))
+#define LED_PORTS LED_PORT(IND_NO_TYPES, 0)
+
+/* defined in main.cpp, shared with the sensors */
+extern I2CBus i2c_bus;
 
 /* LEDController template logic.
  */
@@ -159,42 +175,12 @@ protected:
 };
 
 
-/** Struct definition for the PWM LEDs */
-class RGBLED {
-public:
-    RGBLED(LedPwmOutCC r, LedPwmOutCC g, LedPwmOutCC b)
-        : red(r), green(g), blue(b)
-    {
-    }
-    LedPwmOutCC red;
-    LedPwmOutCC green;
-    LedPwmOutCC blue;
-};
-
 class LEDController : public BaseController {
 public:
-    LEDController() : led_ctrl(I2C_SDA, I2C_SCL, 0x02)
+    LEDController(I2CBus &bus) : _bus(bus), _busy(false)
     {
-        LedPinName pins[] = {
-            L0,  L1,  L2,  // power
-            L3,  L4,  L5,  // wifi
-            L6,  L7,  L8,  // cloud
-            L9,  L10, L11, // firmware upload
-            L12, L13, L14, // light
-            L15, L16, L17, // temperature and humidity
-            L18, L19, L20  // sound
-        };
-        unsigned i;
-
-        led_strip.reserve(IND_NO_TYPES);
-
-        for (i = 0; i + 2 < sizeof(pins) / sizeof(pins[0]); i += 3) {
-            LedPwmOutCC r(led_ctrl, pins[i]);
-            LedPwmOutCC g(led_ctrl, pins[i + 1]);
-            LedPwmOutCC b(led_ctrl, pins[i + 2]);
-            RGBLED rgbled(r, g, b);
-            led_strip.push_back(rgbled);
-        }
+        /* the controller powers up with all outputs off */
+        memset(_pwm_sent, 0, sizeof(_pwm_sent));
     }
 
     ~LEDController()
@@ -203,85 +189,167 @@ public:
 
 private:
     /** Updates the hardware LEDs based on the internal colors and flags set.
+     *
+     * Only the PWM registers that differ from what the controller already
+     * has are written, as one auto-increment burst from the first to the
+     * last of them, without waiting for the bus. When nothing changed no
+     * I2C traffic is generated. If the previous burst is still in flight
+     * the update is left to the next refresh.
      */
     void led_update(void)
     {
-        int idx;
+        int idx, first = -1, last = -1;
+
+        if (_busy) {
+            return;
+        }
 
         for (idx = 0; idx < IND_NO_TYPES; ++idx) {
-            /* set the hardware LEDs */
-            led_strip[idx].red.pwm(getRed(idx));
-            led_strip[idx].green.pwm(getGreen(idx));
-            led_strip[idx].blue.pwm(getBlue(idx));
+            _pwm_pending[LED_PORT(idx, 0)] = getRed(idx);
+            _pwm_pending[LED_PORT(idx, 1)] = getGreen(idx);
+            _pwm_pending[LED_PORT(idx, 2)] = getBlue(idx);
         }
+        for (idx = 0; idx < LED_PORTS; ++idx) {
+            if (_pwm_pending[idx] != _pwm_sent[idx]) {
+                if (first < 0) {
+                    first = idx;
+                }
+                last = idx;
+            }
+        }
+        if (first < 0) {
+            return;
+        }
+
+        _burst_first = first;
+        _burst_last = last;
+        _burst[0] = PCA9956A_AUTO_INCREMENT | (PCA9956A_PWM0 + first);
+        memcpy(&_burst[1], &_pwm_pending[first], last - first + 1);
+
+        _busy = true;
+        if (_bus.transfer(PCA9956A_ADDR, _burst, last - first + 2, NULL, 0,
+                          callback(this, &LEDController::burst_done)) != 0) {
+            _busy = false;
+        }
+    }
+
+    /** Called by the bus once a burst is on the controller, or failed.
+     */
+    void burst_done(int result)
+    {
+        if (result == 0) {
+            memcpy(&_pwm_sent[_burst_first], &_pwm_pending[_burst_first],
+                   _burst_last - _burst_first + 1);
+        }
+        _busy = false;
     }
 
     /** Setup the internal state of the LED colors and flags.
      */
     void led_init(void)
     {
-        for (int i = 0; i < IND_NO_TYPES; i++) {
-            led_strip[i].red.current(1.0f);
-            led_strip[i].green.current(1.0f);
-            led_strip[i].blue.current(1.0f);
-        }
+        /* normal mode, every output dimmed by its own PWM register */
+        char mode[] = {PCA9956A_MODE1, 0x00};
+        char ledout[1 + PCA9956A_LEDOUT_REGS];
+        char pwm[1 + LED_PORTS];
+        char iref[1 + LED_PORTS];
+
+        ledout[0] = PCA9956A_AUTO_INCREMENT | PCA9956A_LEDOUT0;
+        memset(&ledout[1], PCA9956A_LEDOUT_PWM, PCA9956A_LEDOUT_REGS);
+        pwm[0] = PCA9956A_AUTO_INCREMENT | PCA9956A_PWM0;
+        memset(&pwm[1], 0, LED_PORTS);
+        iref[0] = PCA9956A_AUTO_INCREMENT | PCA9956A_IREF0;
+        memset(&iref[1], PCA9956A_IREF_MAX, LED_PORTS);
+
+        _bus.write(PCA9956A_ADDR, mode, sizeof(mode));
+        _bus.write(PCA9956A_ADDR, ledout, sizeof(ledout));
+        _bus.write(PCA9956A_ADDR, pwm, sizeof(pwm));
+        _bus.write(PCA9956A_ADDR, iref, sizeof(iref));
+
+        /* the bus runs transactions in order, so any burst still in
+         * flight has completed by now */
+        memset(_pwm_sent, 0, sizeof(_pwm_sent));
     }
 
-    PCA9956A led_ctrl;             /* physical PWM LED controller */
-    std::vector<RGBLED> led_strip; /* set of RGB LEDs attached to controller */
+    I2CBus &_bus; /* bus of the physical PWM LED controller */
+
+    uint8_t _pwm_sent[LED_PORTS];    /* PWM registers on the controller */
+    uint8_t _pwm_pending[LED_PORTS]; /* PWM registers wanted */
+    char _burst[1 + LED_PORTS];      /* burst in flight */
+    int _burst_first, _burst_last;
+    volatile bool _busy;
 
-    /* simple helper functions for converting 24-bit color to 8-bit, then floats
+    /* simple helper functions for converting 24-bit color to 8-bit duty
+     * cycles
      */
-    float getRed(int led_name)
+    uint8_t getRed(int led_name)
     {
-        return (float)(LED_HARDWARE[led_name] & 0x000000FF) / 256.0f;
+        return LED_HARDWARE[led_name] & 0x000000FF;
     }
-    float getGreen(int led_name)
+    uint8_t getGreen(int led_name)
     {
-        return (float)((LED_HARDWARE[led_name] & 0x0000FF00) >> 8) / 256.0f;
+        return (LED_HARDWARE[led_name] & 0x0000FF00) >> 8;
     }
-    float getBlue(int led_name)
+    uint8_t getBlue(int led_name)
     {
-        return (float)((LED_HARDWARE[led_name] & 0x00FF0000) >> 16) / 256.0f;
+        return (LED_HARDWARE[led_name] & 0x00FF0000) >> 16;
     }
 };
 
-LEDController ledctrl;
+LEDController ledctrl(i2c_bus);
+/* led_post() runs on the display thread while the others set colors */
+static Mutex led_mutex;
 
 // ****************************************************************************
 // Functions
 // ****************************************************************************
 void led_flags_set(int led_name, int flags)
 {
+    led_mutex.lock();
     ledctrl.flags_set(led_name, flags);
+    led_mutex.unlock();
 }
 
 int led_flags_get(int led_name)
 {
-    return ledctrl.flags_get(led_name);
+    led_mutex.lock();
+    int flags = ledctrl.flags_get(led_name);
+    led_mutex.unlock();
+    return flags;
 }
 
 bool led_flag_is_set(int led_name, int flag)
 {
-    return ledctrl.flag_is_set(led_name, flag);
+    led_mutex.lock();
+    bool set = ledctrl.flag_is_set(led_name, flag);
+    led_mutex.unlock();
+    return set;
 }
 
 void led_clear_flag(int led_name, int flag)
 {
+    led_mutex.lock();
     ledctrl.clear_flag(led_name, flag);
+    led_mutex.unlock();
 }
 
 void led_set_color(enum INDICATOR_TYPES led_name, int led_color, int flags)
 {
+    led_mutex.lock();
     ledctrl.set_color(led_name, led_color, flags);
+    led_mutex.unlock();
 }
 
 void led_post(void)
 {
+    led_mutex.lock();
     ledctrl.led_post();
+    led_mutex.unlock();
 }
 
 void led_setup(void)
 {
+    led_mutex.lock();
     ledctrl.led_setup();
+    led_mutex.unlock();
 }
@@ -50,8 +50,36 @@ void copy_string_to_fixed_width(char *dst,
 }
 
 MultiAddrLCD::MultiAddrLCD(PinName rs, PinName e, PinName d4, PinName d5, PinName d6, PinName d7)
-    : _lcd1(rs, e, d4, d5, d6, d7)
+    : _lcd1(rs, e, d4, d5, d6, d7),
+      _column(0), _row(0), _lcd_column(0), _lcd_row(0)
 {
+    /* TextLCD clears the display and homes the cursor */
+    memset(_shadow, ' ', sizeof(_shadow));
+}
+
+/*Sends c unless it is already shown at column, row. Cells off the
+  display are ignored.*/
+void MultiAddrLCD::write_cell(int column, int row, char c)
+{
+    if (column < 0 || column >= LCD_COLUMNS || row < 0 || row >= LCD_ROWS) {
+        return;
+    }
+    if (_shadow[row][column] == c) {
+        return;
+    }
+    if (column != _lcd_column || row != _lcd_row) {
+        _lcd1.locate(column, row);
+    }
+    _lcd1.putc(c);
+    _shadow[row][column] = c;
+
+    /* the LCD moves right after a character, past the end of a line we do
+     * not rely on where it ends up */
+    _lcd_column = column + 1;
+    _lcd_row = row;
+    if (_lcd_column >= LCD_COLUMNS) {
+        _lcd_column = -1;
+    }
 }
 
 /*Only supporting 16x2 LCDs, so string will be truncated at 32
@@ -62,9 +90,11 @@ int MultiAddrLCD::printf(const char *format, ...)
     char buf[33];
     va_list args;
     va_start(args, format);
-    vsnprintf(buf, sizeof(buf), format, args);
+    rc = vsnprintf(buf, sizeof(buf), format, args);
     va_end(args);
-    rc = _lcd1.printf(buf);
+    for (const char *p = buf; *p != '\0'; p++) {
+        putc(*p);
+    }
     return rc;
 }
 
@@ -72,13 +102,18 @@ int MultiAddrLCD::printf(const char *format, ...)
   characters.*/
 int MultiAddrLCD::printline(int line, const char *msg)
 {
-    int rc;
-    char buf[17] = {0};
-    copy_string_to_fixed_width(buf, 16, msg, true);
-    _lcd1.locate(0, line);
-    rc = _lcd1.printf("%s", buf);
+    char buf[LCD_COLUMNS];
+    if (line < 0 || line >= LCD_ROWS) {
+        return 0;
+    }
+    copy_string_to_fixed_width(buf, LCD_COLUMNS, msg, true);
+    for (int i = 0; i < LCD_COLUMNS; i++) {
+        write_cell(i, line, buf[i]);
+    }
+    _column = 0;
+    _row = (line + 1) % LCD_ROWS;
 
-    return rc;
+    return LCD_COLUMNS;
 }
 
 void MultiAddrLCD::setBacklight(TextLCD_Base::LCDBacklight mode)
@@ -94,14 +129,25 @@ void MultiAddrLCD::setCursor(TextLCD_Base::LCDCursor mode)
 void MultiAddrLCD::setUDC(unsigned char c, char *udc_data)
 {
     _lcd1.setUDC(c, udc_data);
+    /* the LCD address now points into the character generator */
+    _lcd_column = -1;
 }
 
+/*Positions off the display are clamped to its edges.*/
 void MultiAddrLCD::locate(int column, int row)
 {
-    _lcd1.locate(column, row);
+    _column = (column < 0) ? 0 : (column >= LCD_COLUMNS) ? LCD_COLUMNS - 1 : column;
+    _row = (row < 0) ? 0 : (row >= LCD_ROWS) ? LCD_ROWS - 1 : row;
 }
 
 void MultiAddrLCD::putc(int c)
 {
-    _lcd1.putc(c);
+    if (c != '\n') {
+        write_cell(_column, _row, c);
+        _column++;
+    }
+    if (c == '\n' || _column >= LCD_COLUMNS) {
+        _column = 0;
+        _row = (_row + 1) % LCD_ROWS;
+    }
 }
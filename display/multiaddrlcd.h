@@ -27,6 +27,9 @@
 
 #include <TextLCD.h>
 
+#define LCD_COLUMNS 16
+#define LCD_ROWS 2
+
 /**
  * Utilty to copy src string to dst where resulting string has a fixed width.
  *
@@ -41,6 +44,10 @@ void copy_string_to_fixed_width(char *dst,
                                 const char fillchar = ' ');
 
 // LCD which can have I2C slave address of eith 0x4e or 0x7e
+//
+// Keeps a copy of what is on the glass and only sends the characters that
+// differ from it, moving the LCD cursor only when the next changed
+// character is not where the cursor already is.
 class MultiAddrLCD {
 public:
 
@@ -61,6 +68,12 @@ public:
 
 private:
     TextLCD _lcd1;
+
+    char _shadow[LCD_ROWS][LCD_COLUMNS]; /* characters on the glass */
+    int _column, _row;                   /* where the next character goes */
+    int _lcd_column, _lcd_row;           /* LCD cursor, -1 when unknown */
+
+    void write_cell(int column, int row, char c);
 };
 
 #endif
@@ -125,11 +125,11 @@ int Keystore::open()
     return 0;
 };
 
-/* mbed-os does not implement tmpnam or tmpfile */
-char *Keystore::mktmp(char *out)
+/* mbed-os does not implement tmpnam or tmpfile, each store gets its own
+ * temporary file next to it so that stores can be written concurrently */
+std::string Keystore::mktmp()
 {
-    snprintf(out, L_tmpnam, "%s", FS_MOUNT_POINT "/keystore.tmp");
-    return out;
+    return realpath() + ".tmp";
 }
 
 void Keystore::write()
@@ -138,21 +138,16 @@ void Keystore::write()
     FILE *fp;
     size_t bytes;
     string real;
-    char fname[L_tmpnam] = {0};
+    string tmp;
 
     //convert the database to file writable string
     std::string strfile = to_file();
 
     //open the file
-    mktmp(fname);
-    if (strlen(fname) == 0) {
-        printf("ERROR: failed to generate tmp file name\n");
-        return;
-    }
-
-    fp = fopen(fname, "w");
+    tmp = mktmp();
+    fp = fopen(tmp.c_str(), "w");
     if (NULL == fp) {
-        printf("ERROR: failed to open tmp file %s: %d\n", fname, -errno);
+        printf("ERROR: failed to open tmp file %s: %d\n", tmp.c_str(), -errno);
         return;
     }
 
@@ -162,10 +157,10 @@ void Keystore::write()
     if (bytes == strfile.length()) {
         real = realpath();
         remove(real.c_str());
-        ret = rename(fname, real.c_str());
+        ret = rename(tmp.c_str(), real.c_str());
         if (0 != ret) {
             printf("ERROR: failed to rename tmp file %s to real file %s\n",
-                   fname, real.c_str());
+                   tmp.c_str(), real.c_str());
         }
     } else {
         printf("ERROR: failed to write contents. length=%d, written=%u\n",
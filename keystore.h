@@ -310,8 +310,8 @@ protected:
     /* returns the real keyfile path including the filesystem mount pount */
     std::string realpath();
 
-    /* creates a temporary file for writing */
-    static char *mktmp(char *out);
+    /* returns the path of the temporary file written before a rename */
+    std::string mktmp();
 };
 
 
@@ -47,8 +47,9 @@
 
 #include <OdinWiFiInterface.h>
 
+#include "I2CBus.h"
 #include "TSL2591.h"
-#include "Sht31/Sht31.h"
+#include "SHT3X.h"
 
 #include "MQTTDataProvider.h"
 #include "DeviceResource.h"
@@ -87,6 +88,24 @@ namespace json = rapidjson;
 #define MBED_CONF_APP_APP_LABEL "dragonfly"
 #endif
 
+#define LIGHT_PERIOD_KEY "sensor.light.period"
+#define DHT_PERIOD_KEY "sensor.dht.period"
+
+/* the default periods are prime number multiples so that the LED
+ * flashing is more appealing */
+#ifndef MBED_CONF_APP_LIGHT_SAMPLE_PERIOD_MS
+#define MBED_CONF_APP_LIGHT_SAMPLE_PERIOD_MS 4700
+#endif
+#ifndef MBED_CONF_APP_DHT_SAMPLE_PERIOD_MS
+#define MBED_CONF_APP_DHT_SAMPLE_PERIOD_MS 5300
+#endif
+#define SENSOR_MIN_PERIOD_MS 100
+
+/* lets the temp/humidity sensor measure on its own at 4 Hz */
+#ifndef MBED_CONF_APP_DHT_PERIODIC
+#define MBED_CONF_APP_DHT_PERIODIC 0
+#endif
+
 #define GEO_LAT_KEY "geo.lat"
 #define GEO_LONG_KEY "geo.long"
 #define GEO_ACCURACY_KEY "geo.accuracy"
@@ -97,6 +116,16 @@ namespace json = rapidjson;
 
 #define JSON_MEM_POOL_INC 64
 
+/* refreshes the display from its own thread, below the sensors and the
+ * cloud client in priority; 0 chains its queue onto the main one */
+#ifndef MBED_CONF_APP_DISPLAY_THREAD
+#define MBED_CONF_APP_DISPLAY_THREAD 1
+#endif
+#define DISPLAY_THREAD_STACK_SIZE 4096
+
+/* how often each queue is checked for how late its events run */
+#define LATENCY_PROBE_PERIOD_MS 1000
+
 #define WEM_VERBOSE_PRINTF(type, fmt, ...) \
     do {\
         if (wem_ ##type ## _verbose_enabled) {\
@@ -114,16 +143,22 @@ enum WEM_THREADS {
 struct dht_sensor {
     uint8_t h_id;
     uint8_t t_id;
-    Sht31 *sensor;
+    SHT3X *sensor;
 
     M2MResource *h_res;
     M2MResource *t_res;
+    M2MDeviceResource *h_dev;
+    M2MDeviceResource *t_dev;
 };
 
 struct light_sensor {
     uint8_t id;
     TSL2591 *sensor;
+    int event_queue_id_finish;
+    uint8_t polls;
+    uint8_t retries;
     M2MResource *res;
+    M2MDeviceResource *dev;
 };
 
 struct sensors {
@@ -132,6 +167,15 @@ struct sensors {
     struct light_sensor light;
 };
 
+struct queue_latency {
+    EventQueue *queue;
+    int event_id;       /* the next probe, 0 when stopped */
+    uint32_t due;       /* tick the next probe should run at */
+    uint32_t count;
+    uint32_t total_ms;
+    uint32_t max_ms;
+};
+
 // ****************************************************************************
 // Globals
 // ****************************************************************************
@@ -139,14 +183,22 @@ static DisplayMan display;
 static M2MClient *m2mclient;
 static NetworkInterface *net;
 static EventQueue evq;
+/* the display refresh runs on this queue, away from the sensors */
+static EventQueue display_evq;
+#if MBED_CONF_APP_DISPLAY_THREAD
+static Thread display_thread(osPriorityBelowNormal, DISPLAY_THREAD_STACK_SIZE);
+#endif
+static struct queue_latency evq_latency = {&evq};
+static struct queue_latency display_evq_latency = {&display_evq};
 static struct sensors sensors;
 /* used to stop auto display refresh during firmware downloads */
 static int display_evq_id;
 static bool wem_sensors_verbose_enabled = false;
 
-static I2C i2c(I2C_SDA, I2C_SCL);
-static TSL2591 tsl2591(i2c, TSL2591_ADDR);
-static Sht31 sht31(I2C_SDA, I2C_SCL);
+/* the sensors and the LED controller all share this bus */
+I2CBus i2c_bus(I2C_SDA, I2C_SCL);
+static TSL2591 tsl2591(i2c_bus, TSL2591_ADDR);
+static SHT3X sht3x(i2c_bus, SHT3X_ADDR);
 
 //our serial interface cli class
 Commander cmd;
@@ -162,6 +214,53 @@ static void display_refresh(DisplayMan *display)
     display->refresh();
 }
 
+/**
+ * Records how late it ran and schedules itself again, so that the
+ * latency of a queue is measured with its own events in it
+ */
+static void latency_probe(struct queue_latency *l)
+{
+    uint32_t now = osKernelGetTickCount();
+
+    if (l->due != 0) {
+        uint32_t late = now - l->due;
+        l->total_ms += late;
+        if (late > l->max_ms) {
+            l->max_ms = late;
+        }
+        l->count++;
+    }
+    l->due = now + LATENCY_PROBE_PERIOD_MS;
+    l->event_id = l->queue->call_in(LATENCY_PROBE_PERIOD_MS, latency_probe, l);
+}
+
+/**
+ * Stops the latency probe of a queue, must run on that queue so that the
+ * probe cannot be rescheduling itself at the same time
+ */
+static void latency_probe_stop(struct queue_latency *l)
+{
+    l->queue->cancel(l->event_id);
+    l->event_id = 0;
+    /* the time stopped is not lateness */
+    l->due = 0;
+}
+
+/**
+ * Stops everything on the display queue for a firmware download and
+ * shows the download view. Runs on the display queue, so no periodic
+ * refresh is still driving the LCD once it is done
+ */
+static void display_fota_start(Semaphore *done)
+{
+    display_evq.cancel(display_evq_id);
+    display_evq_id = 0;
+    latency_probe_stop(&display_evq_latency);
+    display.set_downloading();
+    display.refresh();
+    done->release();
+}
+
 /**
  * Sets the app label on the LCD and Mbed Client
  */
@@ -185,10 +284,12 @@ static void light_init(struct light_sensor *s, M2MClient *mbed_client)
     /* init the driver */
     s->sensor = &tsl2591;
     s->sensor->init();
+    s->sensor->setAutoRange(true);
     s->sensor->enable();
 
     s->res = m2mclient->get_resource(M2MClient::M2MClientResourceLightValue);
     m2mclient->set_resource_value(s->res, "0", 1);
+    s->dev = new M2MDeviceResource(s->res, "lux");
 }
 
 /**
@@ -225,17 +326,44 @@ unsigned int light_sensor_to_lux(float reading) {
     return lroundf(8250.0 * pow(reading, 1.51));
 }
 
+#define LIGHT_POLL_MS 20
+#define LIGHT_MAX_POLLS 5
+#define LIGHT_MAX_RETRIES 2
+
 /**
- * Reads a value from the light sensor and publishes to the display
+ * Completes a light measurement started by light_read and publishes
+ * it to the display
  */
-static void light_read(struct light_sensor *s)
+static void light_finish(struct light_sensor *s)
 {
     size_t size;
     char res_buffer[33] = {0};
     unsigned int lux;
 
-    s->sensor->getALS();
-    s->sensor->calcLux();
+    /* the integration may run a little longer than its nominal time */
+    bool valid = s->sensor->isALSValid();
+    if (!valid && ++s->polls < LIGHT_MAX_POLLS) {
+        s->event_queue_id_finish = evq.call_in(LIGHT_POLL_MS, light_finish, s);
+        return;
+    }
+    if (valid) {
+        s->sensor->readALS();
+    }
+
+    /* never valid in time, or saturated and auto-ranging has picked a
+     * less sensitive range, so measure again right away, or keep the
+     * last value */
+    if (!valid || !s->sensor->calcLux()) {
+        if (++s->retries <= LIGHT_MAX_RETRIES) {
+            s->polls = 0;
+            s->event_queue_id_finish = evq.call_in(s->sensor->startALS(), light_finish, s);
+        } else {
+            s->event_queue_id_finish = 0;
+        }
+        return;
+    }
+    s->event_queue_id_finish = 0;
+
     //light sensor uses a multiplier to adjust for the lightpipe
     lux = s->sensor->lux*3.7;
     WEM_VERBOSE_PRINTF(sensors, "light: %u\n", lux);
@@ -243,6 +371,23 @@ static void light_read(struct light_sensor *s)
 
     display.set_sensor_status(s->id, res_buffer);
     m2mclient->set_resource_value(s->res, res_buffer, size);
+    s->dev->set_sample(lux);
+}
+
+/**
+ * Starts a light measurement, light_finish reads it once the
+ * integration is done so the event queue is never blocked waiting
+ */
+static void light_read(struct light_sensor *s)
+{
+    /* the previous measurement is still running */
+    if (s->event_queue_id_finish != 0) {
+        return;
+    }
+
+    s->polls = 0;
+    s->retries = 0;
+    s->event_queue_id_finish = evq.call_in(s->sensor->startALS(), light_finish, s);
 }
 
 /**
@@ -255,7 +400,10 @@ static void dht_init(struct dht_sensor *s, M2MClient *mbed_client)
     s->h_id = display.register_sensor("Humidity", IND_HUMIDITY);
 
     /* init the driver */
-    s->sensor = &sht31;
+    s->sensor = &sht3x;
+    if (!s->sensor->init(MBED_CONF_APP_DHT_PERIODIC)) {
+        cmd.printf("WARN: temp/humidity sensor did not answer\n");
+    }
 
     s->t_res = mbed_client->get_resource(
                     M2MClient::M2MClientResourceTempValue);
@@ -268,6 +416,10 @@ static void dht_init(struct dht_sensor *s, M2MClient *mbed_client)
 
     display.set_sensor_status(s->h_id, "0");
     mbed_client->set_resource_value(s->h_res, "0", 1);
+
+    /* the same readings as numbers, for MQTT */
+    s->t_dev = new M2MDeviceResource(s->t_res, "C", 1);
+    s->h_dev = new M2MDeviceResource(s->h_res, "%RH");
 }
 
 /**
@@ -279,9 +431,15 @@ static void dht_read(struct dht_sensor *dht)
     float temperature, humidity;
     char res_buffer[33] = {0};
 
+    /* one measurement gives both, keep the last values if it fails */
+    if (!dht->sensor->read(temperature, humidity)) {
+        tr_debug("DHT: read failed\n");
+        return;
+    }
+
     //temp and humidity have multiplier to adjust for the case
-    temperature = dht->sensor->readTemperature() * .68;
-    humidity = dht->sensor->readHumidity() * 1.9;
+    temperature = temperature * .68;
+    humidity = humidity * 1.9;
     tr_debug("DHT: temp = %fC, humi = %f%%\n", temperature, humidity);
 
     /* verbose printing to screen of sensor values */
@@ -294,6 +452,9 @@ static void dht_read(struct dht_sensor *dht)
     size = snprintf(res_buffer, sizeof(res_buffer), "%.0f%%", humidity);
     m2mclient->set_resource_value(dht->h_res, res_buffer, size);
     display.set_sensor_status(dht->h_id, (char *)res_buffer);
+
+    dht->t_dev->set_sample(temperature);
+    dht->h_dev->set_sample(humidity);
 }
 
 /**
@@ -305,15 +466,43 @@ static void sensors_init(struct sensors *sensors, M2MClient *mbed_client)
     light_init(&sensors->light, mbed_client);
 }
 
+/**
+ * Gets a sampling period from the keystore, or the default if it is
+ * not set or not a sensible number
+ */
+static int sensor_period(Keystore &k, const char *key, int period)
+{
+    if (k.exists(key)) {
+        int val = strtol(k.get(key).c_str(), NULL, 10);
+        if (val >= SENSOR_MIN_PERIOD_MS) {
+            period = val;
+        } else {
+            cmd.printf("WARN: ignoring %s, it must be at least %d ms\n",
+                       key, SENSOR_MIN_PERIOD_MS);
+        }
+    }
+    return period;
+}
+
 /**
  * Starts the periodic sampling of sensor data
  */
 static void sensors_start(struct sensors *s, EventQueue *q)
 {
-    cmd.printf("starting all sensors\n");
-    // the periods are prime number multiples so that the LED flashing is more appealing
-    s->event_queue_id_light = q->call_every(4700, light_read, &s->light);
-    s->event_queue_id_dht = q->call_every(5300, dht_read, &s->dht);
+    Keystore k;
+    int light_period, dht_period;
+
+    k.open();
+    light_period = sensor_period(k, LIGHT_PERIOD_KEY,
+                                 MBED_CONF_APP_LIGHT_SAMPLE_PERIOD_MS);
+    dht_period = sensor_period(k, DHT_PERIOD_KEY,
+                               MBED_CONF_APP_DHT_SAMPLE_PERIOD_MS);
+    k.close();
+
+    cmd.printf("starting all sensors, light every %d ms, dht every %d ms\n",
+               light_period, dht_period);
+    s->event_queue_id_light = q->call_every(light_period, light_read, &s->light);
+    s->event_queue_id_dht = q->call_every(dht_period, dht_read, &s->dht);
 }
 
 /**
@@ -324,8 +513,13 @@ static void sensors_stop(struct sensors *s, EventQueue *q)
     cmd.printf("stopping all sensors\n");
     q->cancel(s->event_queue_id_light);
     q->cancel(s->event_queue_id_dht);
+    if (s->light.event_queue_id_finish != 0) {
+        q->cancel(s->light.event_queue_id_finish);
+        s->light.sensor->disable();
+    }
     s->event_queue_id_light = 0;
     s->event_queue_id_dht = 0;
+    s->light.event_queue_id_finish = 0;
 }
 
 // ****************************************************************************
@@ -685,14 +879,19 @@ void fota_auth_download(M2MClient *mbed_client)
     cmd.printf("Firmware download requested\n");
 
     sensors_stop(&sensors, &evq);
+    latency_probe_stop(&evq_latency);
     /* we'll need to manually refresh the display until the firmware
      * update is complete.  it seems that doing *anything* outside of
      * the firmware download's thread context will result in a failed
      * download. */
-    evq.cancel(display_evq_id);
-    display_evq_id = 0;
-    display.set_downloading();
-    display.refresh();
+    Semaphore display_stopped;
+#if MBED_CONF_APP_DISPLAY_THREAD
+    display_evq.call(display_fota_start, &display_stopped);
+    display_stopped.wait();
+#else
+    /* the display queue is dispatched from this one */
+    display_fota_start(&display_stopped);
+#endif
     mbed_client->update_authorize(MbedCloudClient::UpdateRequestDownload);
 
     cmd.printf("Authorization granted\n");
@@ -708,9 +907,11 @@ void fota_auth_install(M2MClient *mbed_client)
     display.set_installing();
 
     /* firmware download is complete, restart the auto display updates */
-    display_evq_id = evq.call_every(DISPLAY_UPDATE_PERIOD_MS,
-                                    display_refresh,
-                                    &display);
+    display_evq_id = display_evq.call_every(DISPLAY_UPDATE_PERIOD_MS,
+                                            display_refresh,
+                                            &display);
+    latency_probe(&evq_latency);
+    display_evq.call(latency_probe, &display_evq_latency);
 
     mbed_client->set_fota_install_requested();
     mbed_client->close();
@@ -752,7 +953,7 @@ void mbed_client_on_update_authorize(int32_t request)
         default:
             cmd.printf("ERROR: unknown request\n");
             led_set_color(IND_FWUP, IND_COLOR_FAILED);
-            led_post();
+            display_evq.call(led_post);
             break;
     }
 }
@@ -1058,7 +1259,8 @@ static int platform_init()
 
 static void platform_shutdown()
 {
-    /* stop the EventQueue */
+    /* stop the EventQueues */
+    display_evq.break_dispatch();
     evq.break_dispatch();
 }
 
@@ -1340,6 +1542,13 @@ static void cmd_cb_set(vector<string>& params)
                    params[1].c_str(),
                    strvalue.c_str());
 
+        //a new sampling period takes effect right away
+        if ((params[1] == LIGHT_PERIOD_KEY || params[1] == DHT_PERIOD_KEY)
+            && sensors.event_queue_id_light != 0) {
+            sensors_stop(&sensors, &evq);
+            sensors_start(&sensors, &evq);
+        }
+
     } else {
         cmd.printf("Not enough arguments!\n");
     }
@@ -1517,6 +1726,60 @@ static void cmd_cb_verbose(vector<string>& params)
     }
 }
 
+static void cmd_cb_history(vector<string>& params)
+{
+    M2MDeviceResource *dev = NULL;
+    uint32_t count = 10;
+    uint32_t cursor;
+    DeviceSample sample;
+
+    if (params.size() < 2) {
+        cmd.printf("ERROR: Invalid usage of history!\n");
+        cmd.printf("Usage: history <light|temperature|humidity> [count], count defaults to 10\n");
+        return;
+    }
+
+    if (params[1] == "light") {
+        dev = sensors.light.dev;
+    } else if (params[1] == "temperature") {
+        dev = sensors.dht.t_dev;
+    } else if (params[1] == "humidity") {
+        dev = sensors.dht.h_dev;
+    } else {
+        cmd.printf("ERROR: unsupported sensor %s!\n", params[1].c_str());
+        return;
+    }
+
+    /* not created until the sensors are initialised, never if disabled */
+    if (dev == NULL) {
+        cmd.printf("ERROR: sensor %s not initialized\n", params[1].c_str());
+        return;
+    }
+
+    if (params.size() >= 3) {
+        count = strtoul(params[2].c_str(), NULL, 10);
+    }
+
+    /* walk the samples oldest first, straight out of the ring */
+    cursor = dev->history_cursor(count);
+    while (dev->next_sample(cursor, sample)) {
+        cmd.printf("%lld %.*f %s\n", sample.time, sample.scale,
+                   sample.to_double(), sample.unit);
+    }
+}
+
+static void print_latency(const char *name, const struct queue_latency *l)
+{
+    cmd.printf("%s: %lu events, avg %lu ms, max %lu ms late\n", name,
+               l->count, l->count ? l->total_ms / l->count : 0, l->max_ms);
+}
+
+static void cmd_cb_latency(vector<string>& params)
+{
+    print_latency("main queue", &evq_latency);
+    print_latency("display queue", &display_evq_latency);
+}
+
 static void cmd_pump(Commander *cmd)
 {
     cmd->pump();
@@ -1565,6 +1828,14 @@ void init_commander(void)
             "Enables verbose printing of sensor values when set 'on'. Usage: verbose <type> [off|on], defeaults to off",
             cmd_cb_verbose);
 
+    cmd.add("history",
+            "Show the most recent samples of a sensor. Usage: history <light|temperature|humidity> [count], defaults to 10",
+            cmd_cb_history);
+
+    cmd.add("latency",
+            "Show how late events run on the main and the display queue. Usage: latency",
+            cmd_cb_latency);
+
     cmd.add("format",
             "Format the internal file system. Usage: format <fs-type>",
             cmd_cb_format);
@@ -1731,15 +2002,20 @@ static void init_app(EventQueue *queue)
 
     std::map<std::string, DeviceResource*>  all_resources_map;
 
-    all_resources_map["light"]=new M2MDeviceResource(sensors.light.res);
-    all_resources_map["temperature"]=new M2MDeviceResource(sensors.dht.t_res);
-    all_resources_map["humidity"]=new M2MDeviceResource(sensors.dht.h_res);
+    all_resources_map["light"]=sensors.light.dev;
+    all_resources_map["temperature"]=sensors.dht.t_dev;
+    all_resources_map["humidity"]=sensors.dht.h_dev;
 
     const ConnectorClientEndpointInfo* endpoint = m2mclient->get_cloud_client().endpoint_info();
     const char* devicename = endpoint->internal_endpoint_name.c_str();
     if (strcmp("",devicename) == 0)
        devicename = "9164246ec9d4000000000001001002f1"; // TBD: some dummy
-    MQTTDataProvider data_provider(devicename, all_resources_map);
+    /* static to keep the sample batches off the init thread's stack */
+    static MQTTDataProvider data_provider(devicename, all_resources_map);
+    /* only report readings that moved more than the sensor noise */
+    data_provider.setDeadband("light", 0, 10);
+    data_provider.setDeadband("temperature", 0.2, 0);
+    data_provider.setDeadband("humidity", 1.0, 0);
     data_provider.run(net);
 }
 
@@ -1747,13 +2023,15 @@ static void init_app(EventQueue *queue)
 // Main
 // main() runs in its own thread in the OS
 //
-// Be aware of 3 threads of execution.
+// Be aware of 4 threads of execution.
 // 1. The init thread is kicked off when the app first starts and is
 // responsible for bringing up the mbed client, the network, the sensors,
 // etc., and exits as soon as initialization is complete.
 // 2. The main thread dispatches the event queue and is where all normal
 // runtime operations are processed.
-// 3. The firmware update thread runs in the context of the mbed client and
+// 3. The display thread, at a lower priority, dispatches the display event
+// queue that refreshes the LCD and the LEDs.
+// 4. The firmware update thread runs in the context of the mbed client and
 // executes callbacks in our app.  When a firmware update begins and a
 // download started, the event queue in the main thread must be halted until
 // the download completes.  Through a good deal of testing, it seems that
@@ -1789,8 +2067,19 @@ int main()
         cmd.printf("init platform: OK\n");
     }
 
+    /* the display gets its own lower priority thread, so a slow LCD or LED
+     * update cannot delay the sensors or the cloud client */
+#if MBED_CONF_APP_DISPLAY_THREAD
+    display_thread.start(callback(&display_evq, &EventQueue::dispatch_forever));
+#else
+    display_evq.chain(&evq);
+#endif
+
     /* set the refresh rate of the display. */
-    display_evq_id = evq.call_every(DISPLAY_UPDATE_PERIOD_MS, display_refresh, &display);
+    display_evq_id = display_evq.call_every(DISPLAY_UPDATE_PERIOD_MS, display_refresh, &display);
+
+    latency_probe(&evq_latency);
+    latency_probe(&display_evq_latency);
 
     /* use a separate thread to init the remaining components so that we
      * can continue to refresh the display */